@@ -0,0 +1,340 @@
+--[[----------------------------------------------------------------------------
+
+    Benchmark suite for the PiXL drawing primitives
+    run it with "make bench" or "cd bench && ../PiXL --headless [options]"
+
+    --time seconds        minimum measuring time per case (default 0.02)
+    --json                print JSON instead of CSV
+    --save file           save the results as CSV baseline
+    --baseline file       compare against a saved baseline
+    --tolerance factor    allowed slowdown against the baseline (default 0.15)
+
+--]]----------------------------------------------------------------------------
+
+package.path = '../extra/?.lua;' .. package.path
+
+local pixl = require('pixl')
+local params = require('params')
+
+local function option(name, default)
+  local value = params.arg(name)
+  return value and tonumber(value) or default
+end
+
+local MIN_TIME = option('--time', 0.02)
+local TOLERANCE = option('--tolerance', 0.15)
+
+local RESOLUTIONS = { { 160, 144 }, { 320, 240 }, { 640, 480 }, { 1280, 720 } }
+local CLIPS = { 'none', 'half' }
+local TRANSLATIONS = { { 0, 0 }, { -17, 23 } }
+local SIZES = { 8, 64, 256 }
+local PRESENT_SAMPLES = 5
+
+local FIELDS = { 'name', 'resolution', 'clip', 'translate', 'size', 'calls', 'seconds', 'ns_per_pixel', 'calls_per_sec' }
+
+--------------------------------------------------------------------------------
+-- helpers
+--------------------------------------------------------------------------------
+local function random_image(width, height, colors)
+  local rows = {}
+  for y = 1, height do
+    local row = {}
+    for x = 1, width do
+      row[x] = string.char(pixl.random(0, colors - 1))
+    end
+    rows[y] = table.concat(row)
+  end
+  return table.concat(rows)
+end
+
+local function measure(fn)
+  local calls, elapsed, batch = 0, 0, 1
+  while elapsed < MIN_TIME do
+    local start = pixl.clock()
+    for i = 1, batch do
+      fn(i)
+    end
+    elapsed = elapsed + (pixl.clock() - start)
+    calls = calls + batch
+    batch = batch * 2
+  end
+  return calls, elapsed
+end
+
+local function key(result)
+  return table.concat({ result.name, result.resolution, result.clip, result.translate, result.size }, '/')
+end
+
+--------------------------------------------------------------------------------
+-- primitives, every entry returns the draw function and the pixels per call
+--------------------------------------------------------------------------------
+local PRIMITIVES = {
+  { 'rect_fill', function(x, y, size)
+    return function(i) pixl.rect(i % 16, x, y, x + size - 1, y + size - 1, true) end, size * size
+  end },
+  { 'rect', function(x, y, size)
+    return function(i) pixl.rect(i % 16, x, y, x + size - 1, y + size - 1) end, 4 * size - 4
+  end },
+  { 'circle_fill', function(x, y, size)
+    local r = size // 2
+    return function(i) pixl.circle(i % 16, x + r, y + r, r, true) end, math.floor(math.pi * r * r)
+  end },
+  { 'circle', function(x, y, size)
+    local r = size // 2
+    return function(i) pixl.circle(i % 16, x + r, y + r, r) end, math.floor(2 * math.pi * r)
+  end },
+  { 'line', function(x, y, size)
+    return function(i) pixl.line(i % 16, x, y, x + size - 1, y + size // 2) end, size
+  end },
+  { 'print', function(x, y, size)
+    local text = string.rep('#', math.max(1, size // 8))
+    return function(i) pixl.print(i % 16, x, y, text) end, #text * 64
+  end },
+  { 'point', function(x, y, size)
+    return function(i)
+      for j = 0, size - 1 do pixl.point(j % 16, x + j, y + j) end
+    end, size
+  end },
+  { 'point_batch', function(x, y, size)
+    local commands = {}
+    for j = 0, size - 1 do
+      commands[#commands + 1] = string.pack('<BBhh', 1, j % 16, x + j, y + j)
+    end
+    commands = table.concat(commands)
+    return function(i) pixl.batch(commands) end, size
+  end },
+  { 'font_print', function(x, y, size)
+    local font = pixl.newfont(random_image(4 * 16, 6, 2), 4, 6, 'abcdefghijklmnäö')
+    local text = string.rep('äbc', math.max(1, size // 12))
+    return function(i) font:print(i % 16, x, y, text) end, font:textwidth(text) * 6
+  end },
+  { 'sprite', function(x, y, size)
+    local data = random_image(size, size, 16)
+    return function() pixl.sprite(x, y, size, size, data, 0) end, size * size
+  end },
+  { 'newsprite', function(x, y, size)
+    local sprite = pixl.newsprite(size, size, random_image(size, size, 16), 0)
+    return function() sprite:draw(x, y) end, size * size
+  end },
+  { 'tilemap', function(x, y, size)
+    local sheet = pixl.newsheet(random_image(64, 8, 16), 64, 8, 8, 8, 0)
+    local tiles = {}
+    for i = 1, (size // 8) * (size // 8) do tiles[i] = pixl.random(0, #sheet - 1) end
+    local map = pixl.newmap(sheet, size // 8, size // 8, tiles)
+    return function() map:draw(-x, -y) end, size * size
+  end },
+}
+
+--------------------------------------------------------------------------------
+-- benchmark cases
+--------------------------------------------------------------------------------
+local function bench_primitives(results, width, height)
+  for _, clip in ipairs(CLIPS) do
+    for _, translation in ipairs(TRANSLATIONS) do
+      for _, size in ipairs(SIZES) do
+        for _, primitive in ipairs(PRIMITIVES) do
+          local name, prepare = primitive[1], primitive[2]
+          local fn, pixels = prepare((width - size) // 2, (height - size) // 2, size)
+
+          pixl.clear()
+          pixl.translate(translation[1], translation[2])
+          if clip == 'half' then
+            pixl.clip(width // 4, height // 4, width * 3 // 4, height * 3 // 4)
+          else
+            pixl.clip(0, 0, width - 1, height - 1)
+          end
+
+          local calls, seconds = measure(fn)
+          results[#results + 1] = {
+            name = name,
+            resolution = width .. 'x' .. height,
+            clip = clip,
+            translate = translation[1] .. ':' .. translation[2],
+            size = size,
+            calls = calls,
+            seconds = seconds,
+            ns_per_pixel = seconds * 1e9 / (calls * pixels),
+            calls_per_sec = calls / seconds,
+          }
+        end
+      end
+    end
+  end
+  pixl.translate(0, 0)
+  pixl.clip(0, 0, width - 1, height - 1)
+end
+
+local function bench_present(results, width, height, colors)
+  -- the fastest of several samples, so a noisy one can't fail the
+  -- comparison of both palettes
+  local data = random_image(width, height, colors)
+  local frames, seconds
+  for _ = 1, PRESENT_SAMPLES do
+    local sample_frames, sample_seconds = 0, 0
+    while sample_seconds < MIN_TIME or sample_frames < 10 do
+      -- redraw the whole screen so every tile is converted again
+      pixl.sprite(0, 0, width, height, data)
+      coroutine.yield()
+      local _, elapsed = pixl.threads()
+      sample_frames, sample_seconds = sample_frames + 1, sample_seconds + elapsed
+    end
+    if not frames or sample_seconds / sample_frames < seconds / frames then
+      frames, seconds = sample_frames, sample_seconds
+    end
+  end
+  local result = {
+    name = 'present' .. colors,
+    resolution = width .. 'x' .. height,
+    clip = 'none',
+    translate = '0:0',
+    size = width * height,
+    calls = frames,
+    seconds = seconds,
+    ns_per_pixel = seconds * 1e9 / (frames * width * height),
+    calls_per_sec = frames / seconds,
+  }
+  results[#results + 1] = result
+  return result
+end
+
+--------------------------------------------------------------------------------
+-- reporting
+--------------------------------------------------------------------------------
+local function load_baseline(filename)
+  local baseline = {}
+  local file = assert(io.open(filename, 'r'))
+  for line in file:lines() do
+    local values = {}
+    for value in string.gmatch(line, '[^,]+') do
+      values[#values + 1] = value
+    end
+    if values[1] ~= 'name' and #values >= #FIELDS then
+      local result = {}
+      for i, field in ipairs(FIELDS) do
+        result[field] = values[i]
+      end
+      baseline[key(result)] = tonumber(result.ns_per_pixel)
+    end
+  end
+  file:close()
+  return baseline
+end
+
+local function format_csv(results, fields)
+  local lines = { table.concat(fields, ',') }
+  for _, result in ipairs(results) do
+    local values = {}
+    for i, field in ipairs(fields) do
+      values[i] = tostring(result[field] or '')
+    end
+    lines[#lines + 1] = table.concat(values, ',')
+  end
+  return table.concat(lines, '\n') .. '\n'
+end
+
+local function format_json(results, fields)
+  local lines = {}
+  for _, result in ipairs(results) do
+    local values = {}
+    for _, field in ipairs(fields) do
+      local value = result[field]
+      if type(value) == 'string' then
+        value = string.format('%q', value)
+      end
+      if value ~= nil then
+        values[#values + 1] = string.format('"%s": %s', field, tostring(value))
+      end
+    end
+    lines[#lines + 1] = '  { ' .. table.concat(values, ', ') .. ' }'
+  end
+  return '[\n' .. table.concat(lines, ',\n') .. '\n]\n'
+end
+
+local function run()
+  local results = {}
+  local palette_regressions = 0
+  pixl.randomseed(47)
+  for _, resolution in ipairs(RESOLUTIONS) do
+    local width, height = resolution[1], resolution[2]
+    pixl.resolution(width, height)
+    bench_primitives(results, width, height)
+    -- using all 256 palette entries must not cost more than using 16
+    local present16 = bench_present(results, width, height, 16)
+    local present256 = bench_present(results, width, height, 256)
+    if present256.ns_per_pixel > present16.ns_per_pixel * (1.0 + TOLERANCE) then
+      palette_regressions = palette_regressions + 1
+    end
+  end
+
+  local fields = { table.unpack(FIELDS) }
+  local regressions = 0
+  local baseline_file = params.arg('--baseline')
+  if baseline_file then
+    local baseline = load_baseline(baseline_file)
+    fields[#fields + 1] = 'baseline_ns_per_pixel'
+    fields[#fields + 1] = 'change'
+    for _, result in ipairs(results) do
+      local previous = baseline[key(result)]
+      if previous then
+        result.baseline_ns_per_pixel = previous
+        result.change = result.ns_per_pixel / previous - 1.0
+        if result.change > TOLERANCE then
+          result.change = result.change .. ' REGRESSION'
+          regressions = regressions + 1
+        end
+      end
+    end
+  end
+
+  io.write(params.has('--json') and format_json(results, fields) or format_csv(results, fields))
+
+  local save_file = params.arg('--save')
+  if save_file then
+    local file = assert(io.open(save_file, 'w'))
+    file:write(format_csv(results, FIELDS))
+    file:close()
+  end
+
+  if regressions > 0 then
+    error(string.format('%d benchmark(s) are more than %d%% slower than the baseline', regressions, TOLERANCE * 100))
+  end
+  if palette_regressions > 0 then
+    error(string.format('256 colors are more than %d%% slower than 16 colors at %d resolution(s)', TOLERANCE * 100, palette_regressions))
+  end
+  pixl.quit()
+end
+
+local benchmark = coroutine.wrap(run)
+
+function update(dt)
+  benchmark()
+end
+
+--[[----------------------------------------------------------------------------
+
+  This is free and unencumbered software released into the public domain.
+
+  Anyone is free to copy, modify, publish, use, compile, sell, or
+  distribute this software, either in source code form or as a compiled
+  binary, for any purpose, commercial or non-commercial, and by any
+  means.
+
+  In jurisdictions that recognize copyright laws, the author or authors
+  of this software dedicate any and all copyright interest in the
+  software to the public domain. We make this dedication for the benefit
+  of the public at large and to the detriment of our heirs and
+  successors. We intend this dedication to be an overt act of
+  relinquishment in perpetuity of all present and future rights to this
+  software under copyright law.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+  OTHER DEALINGS IN THE SOFTWARE.
+
+  For more information, please refer to <http://unlicense.org/>
+
+--]]----------------------------------------------------------------------------
@@ -61,6 +61,16 @@ typedef int SOCKET;
 #define closesocket(s) close(s)
 #endif // _WIN32
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define PIXL_X86 1
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define PIXL_TARGET(t) __attribute__((target(t)))
+#else
+#define PIXL_TARGET(t)
+#endif // __GNUC__
+#endif // x86
+
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -69,11 +79,43 @@ typedef int SOCKET;
 ////////////////////////////////////////////////////////////////////////////////
 #define PIXL_MAX_SCREEN_WIDTH   2048
 #define PIXL_MAX_SCREEN_HEIGHT  2048
+#define PIXL_SCREEN_ALIGNMENT   32
+#define PIXL_DIRTY_TILE_SHIFT   5
+#define PIXL_DIRTY_TILE_SIZE    (1 << PIXL_DIRTY_TILE_SHIFT)
+
+#define PIXL_MAX_THREADS        16
+#define PIXL_MIN_BAND_ROWS      32
 
 #define PIXL_WINDOW_PADDING     64
 
 #define PIXL_SOUND_CHANNELS     8
 
+#define PIXL_HEADLESS_FPS       60
+
+#define PIXL_LIST_METATABLE     "pixl.list"
+#define PIXL_SPRITE_METATABLE   "pixl.sprite"
+#define PIXL_SHEET_METATABLE    "pixl.sheet"
+#define PIXL_MAP_METATABLE      "pixl.map"
+
+#define PIXL_MAX_IMAGE_SIZE     16384
+#define PIXL_MAX_MAP_SIZE       4096
+#define PIXL_EMPTY_TILE         0xFFFF
+
+#define PIXL_GRID_METATABLE     "pixl.grid"
+#define PIXL_FONT_METATABLE     "pixl.font"
+#define PIXL_MAX_GLYPH_SIZE     256
+#define PIXL_MAX_SCALE          1024.0
+#define PIXL_GRID_ID_LIMIT      (1 << 24)
+#define PIXL_GRID_CELL_LIMIT    (1 << 28)
+#define PIXL_GRID_LARGE_CELLS   64
+
+#define PIXL_SPRITE_CACHE_ANCHORS "pixl.spritecache"
+#define PIXL_SPRITE_CACHE_BUCKETS 1024
+#define PIXL_SPRITE_CACHE_LIMIT   (4 * 1024 * 1024)
+#define PIXL_SPRITE_CACHE_SEEN    256
+
+#define PIXL_STATS_FRAMES       128
+
 enum {
   PIXL_BUTTON_A = 1 << 0,
   PIXL_BUTTON_B = 1 << 1,
@@ -87,6 +129,17 @@ enum {
   PIXL_BUTTON_SELECT = 1 << 9
 };
 
+enum {
+  PIXL_PHASE_EVENTS,
+  PIXL_PHASE_UPDATE,
+  PIXL_PHASE_GC,
+  PIXL_PHASE_CONVERT,
+  PIXL_PHASE_COPY,
+  PIXL_PHASE_PRESENT,
+  PIXL_PHASE_FRAME,
+  PIXL_PHASE_COUNT
+};
+
 enum {
   PIXL_WAVEFORM_SILENT,
   PIXL_WAVEFORM_PULSE50,
@@ -95,6 +148,150 @@ enum {
   PIXL_WAVEFORM_NOISE
 };
 
+enum {
+  PIXL_DRAW_POINT = 1,
+  PIXL_DRAW_RECT,
+  PIXL_DRAW_LINE,
+  PIXL_DRAW_SPRITE,
+  PIXL_DRAW_CIRCLE,
+  PIXL_DRAW_POLYGON,
+  PIXL_DRAW_PRINT,
+  PIXL_DRAW_TRANSFORM,
+  PIXL_DRAW_IMAGE
+};
+
+enum {
+  PIXL_FLIP_X = 1 << 0,
+  PIXL_FLIP_Y = 1 << 1
+};
+
+typedef void (*PaletteConverter)(Uint32 *dst, const Uint8 *src, int count);
+
+typedef struct ConvertJob {
+  Uint8 *pixels;
+  const Uint8 *src;
+  int pitch;
+  int width;
+  int height;
+} ConvertJob;
+
+typedef struct ConvertWorker {
+  SDL_Thread *thread;
+  SDL_sem *start;
+  SDL_bool quit;
+  ConvertJob job;
+} ConvertWorker;
+
+typedef struct PolygonEdge {
+  int top;
+  int bottom;
+  int x;
+  int dx;
+  int cross;
+} PolygonEdge;
+
+typedef struct DrawCommand {
+  int op;
+  int color;
+  int x1, y1;
+  int x2, y2;       // end point, radius or sprite size
+  int fill;         // fill flag or transparent sprite color
+  int length;       // bytes of text, points, pixels or spans following the command
+} DrawCommand;
+
+typedef struct DisplayList {
+  size_t size;      // bytes of commands following the header
+} DisplayList;
+
+typedef struct SpriteSpan {
+  int x;
+  int length;
+} SpriteSpan;
+
+typedef struct SpriteImage {
+  int width, height;
+  int pitch;
+  int transparent;
+  SDL_Rect bounds;          // opaque pixels, empty if there are none
+  const Uint8 *pixels;      // height rows of pitch colors
+  const int *rows;          // first span of every row, height + 1 entries
+  const SpriteSpan *spans;  // opaque runs of every row, left to right
+  const Uint64 *mask;       // one bit per opaque pixel, rows of mask_pitch words
+  int mask_pitch;
+} SpriteImage;
+
+typedef struct SpriteTransform {
+  double angle;             // radians, clockwise on screen
+  double scale;
+  double pivot_x, pivot_y;  // in sprite pixels, placed at the draw position
+} SpriteTransform;
+
+typedef struct SpriteSheet {
+  int columns;
+  int count;                // cells follow the header as SpriteImages
+} SpriteSheet;
+
+typedef struct TileMap {
+  int width, height;
+  const SpriteSheet *sheet; // kept alive as the user value of the map
+} TileMap;
+
+typedef struct GlyphRow {
+  Uint8 count;              // opaque runs of the row, at most 4
+  Uint8 x[4];
+  Uint8 length[4];
+} GlyphRow;
+
+typedef struct FontGlyph {
+  Uint32 code;              // code point above 255, 0 marks a free slot
+  SDL_bool valid;           // rows match bits
+  Uint8 bits[8];
+  GlyphRow rows[8];
+} FontGlyph;
+
+typedef struct FontChar {
+  Uint32 code;
+  int index;
+} FontChar;
+
+typedef struct BitmapFont {
+  int width, height;        // size of every glyph
+  int count;                // glyphs
+  int extra;                // sorted FontChars above Latin-1 follow the header
+  int latin1[256];          // glyph of every Latin-1 code point, -1 if missing
+} BitmapFont;
+
+typedef struct GridBox {
+  double x, y, w, h;
+  Uint32 stamp;             // last query that returned the box
+  int active;
+  int large;                // covers too many cells, kept in the large list
+} GridBox;
+
+typedef struct SpatialGrid {
+  double cell_size;
+  SDL_bool dirty;           // boxes changed since the buckets were built
+  Uint32 stamp;
+  int count;                // boxes in the grid
+  int id_limit;             // highest id ever inserted + 1
+  int buckets;              // power of two, hashed from the cell coordinates
+  GridBox *boxes;           // indexed by id
+  int *starts, *ends;       // items of every bucket
+  int *items;               // box ids
+  int *large;               // ids of boxes scanned linearly
+  int large_count;
+  int boxes_size, starts_size, ends_size, items_size, large_size;
+} SpatialGrid;
+
+typedef struct SpriteCacheEntry {
+  const char *key;          // the anchored Lua string
+  Uint32 hash;
+  size_t size;
+  struct SpriteCacheEntry *next;
+  struct SpriteCacheEntry *newer, *older;
+  SpriteImage image;
+} SpriteCacheEntry;
+
 typedef struct SoundChannel {
   int waveform;
   int cycle;
@@ -114,13 +311,57 @@ SDL_Renderer *renderer = NULL;
 SDL_Texture *texture = NULL;
 SDL_AudioDeviceID audio_device = 0;
 
+SDL_bool headless = SDL_FALSE;
+int headless_frames = 0;
+Uint32 frame_count = 0;
+
+Uint64 frame_stats[PIXL_STATS_FRAMES][PIXL_PHASE_COUNT];
+int frame_stats_index = 0, frame_stats_count = 0;
+Uint32 *offscreen = NULL;
+
 SOCKET udp = INVALID_SOCKET;
 
-Uint8 screen[PIXL_MAX_SCREEN_WIDTH][PIXL_MAX_SCREEN_HEIGHT];
-int screen_width = 0, screen_height = 0;
+Uint8 *screen = NULL;
+int screen_width = 0, screen_height = 0, screen_pitch = 0;
 SDL_Point translation = { 0, 0 };
 int clip_xl = 0, clip_yl = 0, clip_xh = 0, clip_yh = 0;
 
+Uint8 *dirty_tiles = NULL;
+int dirty_tiles_width = 0, dirty_tiles_height = 0;
+SDL_bool screen_dirty = SDL_TRUE;
+SDL_bool screen_exposed = SDL_TRUE;
+Uint32 idle_delay = 16;
+
+Uint32 palette[256];
+SDL_bool palette_dirty = SDL_TRUE;
+PaletteConverter palette_converter = NULL;
+
+ConvertWorker convert_workers[PIXL_MAX_THREADS];
+int convert_worker_count = 0;
+SDL_sem *convert_done = NULL;
+double convert_time = 0.0;
+int thread_count = 1;
+
+PolygonEdge *polygon_edges = NULL;
+int polygon_edges_size = 0;
+int *polygon_points = NULL;
+int polygon_points_size = 0;
+
+SDL_bool recording = SDL_FALSE;
+Uint8 *record_buffer = NULL;
+int record_size = 0, record_capacity = 0;
+
+SpriteCacheEntry *sprite_cache[PIXL_SPRITE_CACHE_BUCKETS];
+SpriteCacheEntry *sprite_cache_newest = NULL, *sprite_cache_oldest = NULL;
+size_t sprite_cache_size = 0, sprite_cache_limit = PIXL_SPRITE_CACHE_LIMIT;
+Uint64 sprite_cache_hits = 0, sprite_cache_misses = 0;
+Uint32 sprite_cache_seen[PIXL_SPRITE_CACHE_SEEN]; // hashes of recent misses
+
+GlyphRow glyph_rows[256][8];
+SDL_bool glyph_rows_valid[256];
+FontGlyph *font_glyphs = NULL;
+int font_glyphs_size = 0, font_glyphs_count = 0;
+
 SoundChannel sound_channels[PIXL_SOUND_CHANNELS];
 float sound_sample_rate = 0.0f;
 
@@ -153,8 +394,8 @@ static SDL_Color colors[256] = {
   { 0xDE, 0xEE, 0xD6, 0xFF }    // White
 };
 
-// basic ASCII font (bit encoded)
-Uint8 font[128][8] = {
+// basic ASCII font (bit encoded), the Latin-1 glyphs 128-255 start empty
+Uint8 font[256][8] = {
   { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },   // U+0000 (nul)
   { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },   // U+0001
   { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },   // U+0002
@@ -293,13 +534,36 @@ Uint8 font[128][8] = {
 ////////////////////////////////////////////////////////////////////////////////
 static void pixl_set_resolution(lua_State *L, int width, int height, double aspect) {
   SDL_DisplayMode mode;
+  // pad every row so it starts on a SIMD friendly boundary
+  int pitch = (width + PIXL_SCREEN_ALIGNMENT - 1) & ~(PIXL_SCREEN_ALIGNMENT - 1);
+
+  int tiles_width = (width + PIXL_DIRTY_TILE_SIZE - 1) >> PIXL_DIRTY_TILE_SHIFT;
+  int tiles_height = (height + PIXL_DIRTY_TILE_SIZE - 1) >> PIXL_DIRTY_TILE_SHIFT;
 
   if (texture) SDL_DestroyTexture(texture);
-  screen_width = screen_height = 0;
-  texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, width, height);
-  if (texture == NULL) luaL_error(L, "SDL_CreateTexture() failed: %s", SDL_GetError());
-  screen_width = width; screen_height = height;
+  if (offscreen) SDL_free(offscreen);
+  if (screen) SDL_free(screen);
+  if (dirty_tiles) SDL_free(dirty_tiles);
+  texture = NULL; offscreen = NULL; screen = NULL; dirty_tiles = NULL;
+  screen_width = screen_height = screen_pitch = 0;
+  dirty_tiles_width = dirty_tiles_height = 0;
+  if (headless) {
+    // there is no renderer, so the screen is converted into plain memory
+    offscreen = (Uint32*)SDL_malloc(width * height * sizeof(Uint32));
+    if (offscreen == NULL) luaL_error(L, "cannot allocate offscreen buffer");
+  } else {
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, width, height);
+    if (texture == NULL) luaL_error(L, "SDL_CreateTexture() failed: %s", SDL_GetError());
+  }
+  screen = (Uint8*)SDL_calloc(height, pitch);
+  dirty_tiles = (Uint8*)SDL_malloc(tiles_width * tiles_height);
+  if ((screen == NULL) || (dirty_tiles == NULL)) luaL_error(L, "cannot allocate screen buffer");
+  screen_width = width; screen_height = height; screen_pitch = pitch;
+  dirty_tiles_width = tiles_width; dirty_tiles_height = tiles_height;
+  SDL_memset(dirty_tiles, 1, tiles_width * tiles_height);
+  screen_dirty = SDL_TRUE;
   clip_xl = 0; clip_yl = 0; clip_xh = width; clip_yh = height;
+  if (headless) return;
 
   if (aspect) height = (int)((1.0 / aspect) * (double)width);
   if (SDL_RenderSetLogicalSize(renderer, width, height)) luaL_error(L, "SDL_RenderSetLogicalSize() failed: %s", SDL_GetError());
@@ -310,6 +574,7 @@ static void pixl_set_resolution(lua_State *L, int width, int height, double aspe
     int factor = factory > factorx ? factorx : factory;
     SDL_SetWindowSize(window, width * factor, height * factor);
     SDL_SetWindowPosition(window, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED);
+    if (mode.refresh_rate > 0) idle_delay = 1000 / mode.refresh_rate;
   }
 }
 
@@ -325,19 +590,228 @@ static void pixl_open_controllers(lua_State *L) {
   }
 }
 
+static void pixl_mark_dirty(int x1, int y1, int x2, int y2) {
+  Uint8 *row;
+  int width = (x2 >> PIXL_DIRTY_TILE_SHIFT) - (x1 >> PIXL_DIRTY_TILE_SHIFT) + 1;
+  y1 >>= PIXL_DIRTY_TILE_SHIFT; y2 >>= PIXL_DIRTY_TILE_SHIFT;
+  row = dirty_tiles + (y1 * dirty_tiles_width) + (x1 >> PIXL_DIRTY_TILE_SHIFT);
+  for (; y1 <= y2; ++y1, row += dirty_tiles_width) SDL_memset(row, 1, width);
+  screen_dirty = SDL_TRUE;
+}
+
+static void pixl_mark_dirty_all() {
+  SDL_memset(dirty_tiles, 1, dirty_tiles_width * dirty_tiles_height);
+  screen_dirty = SDL_TRUE;
+}
+
 static void pixl_pset(Uint8 color, int x, int y) {
   x += translation.x;
   y += translation.y;
   if ((x >= 0) && (x < screen_width) && (y >= 0) && (y < screen_height)) {
     if ((x >= clip_xl) && (x <= clip_xh) && (y >= clip_yl) && (y <= clip_yh)) {
-      screen[x][y] = color;
+      screen[y * screen_pitch + x] = color;
+      dirty_tiles[(y >> PIXL_DIRTY_TILE_SHIFT) * dirty_tiles_width + (x >> PIXL_DIRTY_TILE_SHIFT)] = 1;
+      screen_dirty = SDL_TRUE;
     }
   }
 }
 
+static void pixl_fill(Uint8 color, int x1, int y1, int x2, int y2) {
+  Uint8 *row;
+  int xl = clip_xl > 0 ? clip_xl : 0;
+  int yl = clip_yl > 0 ? clip_yl : 0;
+  int xh = clip_xh < screen_width - 1 ? clip_xh : screen_width - 1;
+  int yh = clip_yh < screen_height - 1 ? clip_yh : screen_height - 1;
+
+  x1 += translation.x; x2 += translation.x;
+  y1 += translation.y; y2 += translation.y;
+  if (x1 < xl) x1 = xl;
+  if (y1 < yl) y1 = yl;
+  if (x2 > xh) x2 = xh;
+  if (y2 > yh) y2 = yh;
+  if ((x1 > x2) || (y1 > y2)) return;
+
+  pixl_mark_dirty(x1, y1, x2, y2);
+  row = screen + (y1 * screen_pitch) + x1;
+  if (x1 == x2) {
+    for (; y1 <= y2; ++y1, row += screen_pitch) *row = color;
+  } else {
+    for (; y1 <= y2; ++y1, row += screen_pitch) SDL_memset(row, color, x2 - x1 + 1);
+  }
+}
+
+static int pixl_isqrt(Sint64 n) {
+  Sint64 r = (Sint64)SDL_sqrt((double)n);
+  while (r * r > n) --r;
+  while ((r + 1) * (r + 1) <= n) ++r;
+  return (int)r;
+}
+
+static void pixl_circle(Uint8 color, int x, int y, int radius, int fill) {
+  // exactly the pixels with (radius - 1)^2 <= distance^2 <= radius^2, row by row
+  Sint64 r0sq = fill ? 0 : (Sint64)(radius - 1) * (radius - 1);
+  Sint64 r1sq = (Sint64)radius * radius;
+  int ry = SDL_max(SDL_max(clip_yl, 0) - translation.y - y, -radius);
+  int ry2 = SDL_min(SDL_min(clip_yh, screen_height - 1) - translation.y - y, radius);
+  int inner, outer;
+  Sint64 t;
+
+  for (; ry <= ry2; ++ry) {
+    outer = pixl_isqrt(r1sq - (Sint64)ry * ry);
+    t = r0sq - (Sint64)ry * ry;
+    if (t <= 0) {
+      pixl_fill(color, x - outer, y + ry, x + outer, y + ry);
+      continue;
+    }
+    inner = pixl_isqrt(t);
+    if ((Sint64)inner * inner < t) ++inner;
+    if (inner > outer) continue;
+    pixl_fill(color, x - outer, y + ry, x - inner, y + ry);
+    pixl_fill(color, x + inner, y + ry, x + outer, y + ry);
+  }
+}
+
+static void pixl_line(Uint8 color, int x1, int y1, int x2, int y2) {
+  // the same pixels as a Bresenham walk from (x1, y1) to (x2, y2), started
+  // directly at the first step inside the clip window. With D the major and
+  // d the minor length, step k is at minor offset ceil((k * d - D / 2) / D).
+  Sint64 xl = SDL_max(clip_xl, 0) - translation.x;
+  Sint64 yl = SDL_max(clip_yl, 0) - translation.y;
+  Sint64 xh = SDL_min(clip_xh, screen_width - 1) - translation.x;
+  Sint64 yh = SDL_min(clip_yh, screen_height - 1) - translation.y;
+  Sint64 dx = x2 > x1 ? (Sint64)x2 - x1 : (Sint64)x1 - x2;
+  Sint64 dy = y2 > y1 ? (Sint64)y2 - y1 : (Sint64)y1 - y2;
+  int sx = x1 < x2 ? 1 : -1, sy = y1 < y2 ? 1 : -1;
+  Sint64 major, minor, lo, hi, k, k1, m, err, half;
+  int x, y;
+
+  if (y1 == y2) {
+    pixl_fill(color, SDL_min(x1, x2), y1, SDL_max(x1, x2), y1);
+    return;
+  }
+  if (x1 == x2) {
+    pixl_fill(color, x1, SDL_min(y1, y2), x1, SDL_max(y1, y2));
+    return;
+  }
+
+  if (dx > dy) {
+    major = dx; minor = dy;
+    k = sx > 0 ? xl - x1 : x1 - xh; k1 = sx > 0 ? xh - x1 : x1 - xl;
+    lo = sy > 0 ? yl - y1 : y1 - yh; hi = sy > 0 ? yh - y1 : y1 - yl;
+  } else {
+    major = dy; minor = dx;
+    k = sy > 0 ? yl - y1 : y1 - yh; k1 = sy > 0 ? yh - y1 : y1 - yl;
+    lo = sx > 0 ? xl - x1 : x1 - xh; hi = sx > 0 ? xh - x1 : x1 - xl;
+  }
+  half = major / 2;
+  if (k < 0) k = 0;
+  if (k1 > major) k1 = major;
+  if (hi < 0) return;
+  if (lo > 0) k = SDL_max(k, ((lo - 1) * major + half) / minor + 1);
+  if (hi < minor) k1 = SDL_min(k1, (hi * major + half) / minor);
+  if (k > k1) return;
+
+  m = (k * minor - half + major - 1) / major;
+  err = half - k * minor + m * major;
+  x = (int)(x1 + sx * (dx > dy ? k : m)) + translation.x;
+  y = (int)(y1 + sy * (dx > dy ? m : k)) + translation.y;
+  for (;;) {
+    screen[y * screen_pitch + x] = color;
+    dirty_tiles[(y >> PIXL_DIRTY_TILE_SHIFT) * dirty_tiles_width + (x >> PIXL_DIRTY_TILE_SHIFT)] = 1;
+    if (k++ == k1) break;
+    err -= minor;
+    if (dx > dy) {
+      x += sx;
+      if (err < 0) { err += major; y += sy; }
+    } else {
+      y += sy;
+      if (err < 0) { err += major; x += sx; }
+    }
+  }
+  screen_dirty = SDL_TRUE;
+}
+
+static SDL_bool pixl_reserve(void **buffer, int *size, int count, size_t element) {
+  void *grown;
+  if (count <= *size) return SDL_TRUE;
+  if (count < *size * 2) count = *size * 2;
+  grown = SDL_realloc(*buffer, count * element);
+  if (!grown) return SDL_FALSE;
+  *buffer = grown;
+  *size = count;
+  return SDL_TRUE;
+}
+
+static int pixl_compare_edges(const void *a, const void *b) {
+  return ((const PolygonEdge*)a)->top - ((const PolygonEdge*)b)->top;
+}
+
+static int pixl_polygon(Uint8 color, const int *points, int count, int fill) {
+  // pixel centres sit on integer coordinates, a row is covered between pairs
+  // of edge crossings (even-odd) and the top and left edges are inclusive
+  int i, y, y2, active, pending, edges = 0;
+  PolygonEdge *edge, tmp;
+  const int *a, *b;
+  Sint64 n, d;
+
+  if (count < 1) return 0;
+  if (!fill) {
+    for (i = 0; i < count; ++i) {
+      a = points + i * 2; b = points + ((i + 1) % count) * 2;
+      pixl_line(color, a[0], a[1], b[0], b[1]);
+    }
+    return 0;
+  }
+
+  if (!pixl_reserve((void**)&polygon_edges, &polygon_edges_size, count, sizeof(PolygonEdge))) return -1;
+  y = SDL_MAX_SINT32; y2 = SDL_MIN_SINT32;
+  for (i = 0; i < count; ++i) {
+    a = points + i * 2; b = points + ((i + 1) % count) * 2;
+    if (a[1] == b[1]) continue;
+    if (a[1] > b[1]) { a = b; b = points + i * 2; }
+    edge = &polygon_edges[edges++];
+    edge->top = a[1]; edge->bottom = b[1];
+    edge->x = a[0]; edge->dx = b[0] - a[0];
+    if (a[1] < y) y = a[1];
+    if (b[1] > y2) y2 = b[1];
+  }
+  if (edges == 0) return 0;
+  y = SDL_max(y, SDL_max(clip_yl, 0) - translation.y);
+  y2 = SDL_min(y2 - 1, SDL_min(clip_yh, screen_height - 1) - translation.y);
+  if (y > y2) return 0;
+  SDL_qsort(polygon_edges, edges, sizeof(PolygonEdge), pixl_compare_edges);
+
+  // polygon_edges[active..pending) are the edges crossing the current row
+  for (active = pending = 0; y <= y2; ++y) {
+    while ((pending < edges) && (polygon_edges[pending].top <= y)) ++pending;
+    for (i = active; i < pending; ++i) {
+      edge = &polygon_edges[i];
+      if (edge->bottom <= y) {
+        tmp = polygon_edges[active]; polygon_edges[active++] = *edge; *edge = tmp;
+        continue;
+      }
+      // ceil(x + (y - top) * dx / (bottom - top))
+      n = (Sint64)(y - edge->top) * edge->dx;
+      d = edge->bottom - edge->top;
+      edge->cross = edge->x + (int)(n >= 0 ? (n + d - 1) / d : -(-n / d));
+    }
+    for (i = active + 1; i < pending; ++i) {
+      tmp = polygon_edges[i];
+      for (edge = &polygon_edges[i]; (edge > &polygon_edges[active]) && (edge[-1].cross > tmp.cross); --edge) edge[0] = edge[-1];
+      *edge = tmp;
+    }
+    for (i = active; i + 1 < pending; i += 2) {
+      if (polygon_edges[i].cross < polygon_edges[i + 1].cross) {
+        pixl_fill(color, polygon_edges[i].cross, y, polygon_edges[i + 1].cross - 1, y);
+      }
+    }
+  }
+  return 0;
+}
+
 static Uint8 pixl_pget(int x, int y) {
   if ((x >= 0) && (x < screen_width) && (y >= 0) && (y < screen_height)) {
-    return screen[x][y];
+    return screen[y * screen_pitch + x];
   }
   return 0;
 }
@@ -352,6 +826,12 @@ static Uint32 pixl_xorshift(Uint32 *seed) {
   return x;
 }
 
+static void pixl_stats_phase(int phase, Uint64 *start) {
+  Uint64 now = SDL_GetPerformanceCounter();
+  frame_stats[frame_stats_index][phase] += now - *start;
+  *start = now;
+}
+
 static void pixl_sound(int slot, int waveform, float frequency, float duration) {
   if (slot < 0 || slot >= PIXL_SOUND_CHANNELS) return;
   SoundChannel *channel = &sound_channels[slot];
@@ -372,6 +852,774 @@ static void pixl_sound(int slot, int waveform, float frequency, float duration)
 }
 
 #define pixl_swap(T, a, b) do { T __tmp__ = a; a = b; b = __tmp__; } while(0)
+#define pixl_align(n) (((n) + (int)sizeof(int) - 1) & ~((int)sizeof(int) - 1))
+
+static void pixl_rect(Uint8 color, int x1, int y1, int x2, int y2, int fill) {
+  if (x1 > x2) pixl_swap(int, x1, x2);
+  if (y1 > y2) pixl_swap(int, y1, y2);
+
+  if (fill) {
+    pixl_fill(color, x1, y1, x2, y2);
+  } else {
+    pixl_fill(color, x1, y1, x2, y1);
+    pixl_fill(color, x1, y2, x2, y2);
+    pixl_fill(color, x1, y1 + 1, x1, y2 - 1);
+    pixl_fill(color, x2, y1 + 1, x2, y2 - 1);
+  }
+}
+
+static void pixl_sprite(int x, int y, int w, int h, const Uint8 *data, int transparent) {
+  int px, py;
+  for (py = 0; py < h; ++py) {
+    for (px = 0; px < w; ++px) {
+      Uint8 color = *data++;
+      if (color != transparent) pixl_pset(color, x + px, y + py);
+    }
+  }
+}
+
+static int pixl_count_spans(const Uint8 *data, int pitch, int w, int h, int transparent) {
+  int px, py, spans = 0;
+  for (py = 0; py < h; ++py, data += pitch) {
+    for (px = 0; px < w; ++px) {
+      if ((data[px] != transparent) && ((px == 0) || (data[px - 1] == transparent))) ++spans;
+    }
+  }
+  return spans;
+}
+
+static size_t pixl_image_size(const Uint8 *data, int pitch, int w, int h, int transparent) {
+  // bytes needed for the collision mask, the row index and the spans of an
+  // image, a multiple of 8 so images can be packed into one block
+  int spans = pixl_count_spans(data, pitch, w, h, transparent);
+  size_t size;
+  size = (h + 1) * sizeof(int) + spans * sizeof(SpriteSpan);
+  return h * ((w + 63) / 64) * sizeof(Uint64) + ((size + 7) & ~(size_t)7);
+}
+
+static void pixl_image_spans(SpriteImage *image, int *rows, SpriteSpan *spans, Uint64 *mask) {
+  // decode the rows, spans, bounds and optionally the collision mask from
+  // the size, pixels and transparent color of the image
+  int px, py, count = 0, w = image->width, h = image->height, transparent = image->transparent;
+  int xl = w, yl = h, xh = -1, yh = -1;
+
+  if (mask) SDL_memset(mask, 0, h * image->mask_pitch * sizeof(Uint64));
+  for (py = 0; py < h; ++py) {
+    const Uint8 *row = image->pixels + py * image->pitch;
+    rows[py] = count;
+    for (px = 0; px < w; ++px) {
+      if (row[px] == transparent) continue;
+      if (mask) mask[py * image->mask_pitch + px / 64] |= (Uint64)1 << (px & 63);
+      if ((px == 0) || (row[px - 1] == transparent)) {
+        spans[count].x = px;
+        spans[count++].length = 0;
+      }
+      ++spans[count - 1].length;
+    }
+    if (rows[py] != count) {
+      xl = SDL_min(xl, spans[rows[py]].x);
+      xh = SDL_max(xh, spans[count - 1].x + spans[count - 1].length - 1);
+      yl = SDL_min(yl, py);
+      yh = py;
+    }
+  }
+  rows[h] = count;
+
+  image->bounds.x = xl; image->bounds.w = xh - xl + 1;
+  image->bounds.y = yl; image->bounds.h = yh - yl + 1;
+  image->rows = rows;
+  image->spans = spans;
+  image->mask = mask;
+}
+
+static void pixl_image_init(SpriteImage *image, void *memory, const Uint8 *pixels, int pitch, int w, int h, int transparent) {
+  // memory holds pixl_image_size() bytes and must be 8 byte aligned, the
+  // pixels are referenced, not copied
+  Uint64 *mask = (Uint64*)memory;
+  int *rows;
+
+  image->width = w;
+  image->height = h;
+  image->pitch = pitch;
+  image->transparent = transparent;
+  image->pixels = pixels;
+  image->mask_pitch = (w + 63) / 64;
+  rows = (int*)(mask + h * image->mask_pitch);
+  pixl_image_spans(image, rows, (SpriteSpan*)(rows + h + 1), mask);
+}
+
+static Uint64 pixl_mask_bits(const Uint64 *row, int words, int x) {
+  // 64 mask bits starting at pixel x, pixels past the row are clear
+  int i = x / 64, shift = x & 63;
+  Uint64 bits = row[i] >> shift;
+  if (shift && (i + 1 < words)) bits |= row[i + 1] << (64 - shift);
+  return bits;
+}
+
+static int pixl_collide(const SpriteImage *a, int xa, int ya, const SpriteImage *b, int xb, int yb, int *cx, int *cy) {
+  // AND both masks inside the overlap of the opaque bounds, 64 pixels at a
+  // time, the first contact is the top most, then left most common pixel
+  int x1 = SDL_max(xa + a->bounds.x, xb + b->bounds.x);
+  int y1 = SDL_max(ya + a->bounds.y, yb + b->bounds.y);
+  int x2 = SDL_min(xa + a->bounds.x + a->bounds.w, xb + b->bounds.x + b->bounds.w) - 1;
+  int y2 = SDL_min(ya + a->bounds.y + a->bounds.h, yb + b->bounds.y + b->bounds.h) - 1;
+  const Uint64 *row_a, *row_b;
+  Uint64 bits;
+  int x, y;
+
+  for (y = y1; y <= y2; ++y) {
+    row_a = a->mask + (y - ya) * a->mask_pitch;
+    row_b = b->mask + (y - yb) * b->mask_pitch;
+    for (x = x1; x <= x2; x += 64) {
+      // bits right of x2 are outside the bounds of one image and always clear
+      bits = pixl_mask_bits(row_a, a->mask_pitch, x - xa) & pixl_mask_bits(row_b, b->mask_pitch, x - xb);
+      if (bits) {
+        for (*cx = x; !(bits & 1); bits >>= 1) ++*cx;
+        *cy = y;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static void pixl_image_draw(const SpriteImage *image, int x, int y, int flip) {
+  // flipped images walk the source rows and spans in reverse order
+  int xl = SDL_max(clip_xl, 0), yl = SDL_max(clip_yl, 0);
+  int xh = SDL_min(clip_xh, screen_width - 1), yh = SDL_min(clip_yh, screen_height - 1);
+  int w = image->width, h = image->height;
+  int bx = flip & PIXL_FLIP_X ? w - image->bounds.x - image->bounds.w : image->bounds.x;
+  int by = flip & PIXL_FLIP_Y ? h - image->bounds.y - image->bounds.h : image->bounds.y;
+  int py, py2, sx, sx2, row;
+  const SpriteSpan *span, *last;
+  const Uint8 *src;
+  Uint8 *dst;
+
+  x += translation.x; y += translation.y;
+  py = SDL_max(yl - y, by);
+  py2 = SDL_min(yh - y, by + image->bounds.h - 1);
+  if ((py > py2) || (x + bx > xh) || (x + bx + image->bounds.w <= xl)) return;
+  pixl_mark_dirty(SDL_max(x + bx, xl), y + py, SDL_min(x + bx + image->bounds.w - 1, xh), y + py2);
+
+  for (; py <= py2; ++py) {
+    row = flip & PIXL_FLIP_Y ? h - 1 - py : py;
+    dst = screen + (y + py) * screen_pitch + x;
+    src = image->pixels + row * image->pitch;
+    last = image->spans + image->rows[row + 1];
+    for (span = image->spans + image->rows[row]; span < last; ++span) {
+      if (flip & PIXL_FLIP_X) {
+        sx = SDL_max(w - span->x - span->length, xl - x);
+        sx2 = SDL_min(w - span->x, xh - x + 1);
+        for (; sx < sx2; ++sx) dst[sx] = src[w - 1 - sx];
+      } else {
+        sx = SDL_max(span->x, xl - x);
+        sx2 = SDL_min(span->x + span->length, xh - x + 1);
+        if (sx < sx2) SDL_memcpy(dst + sx, src + sx, sx2 - sx);
+      }
+    }
+  }
+}
+
+static Sint32 pixl_fixed(double v) {
+  // clamped so that stepping across a screen row can't leave 32 bits
+  v = SDL_floor(v * 65536.0);
+  return (Sint32)SDL_max(SDL_min(v, 1073741824.0), -1073741824.0);
+}
+
+static void pixl_transform(const Uint8 *pixels, int pitch, int transparent, const SDL_Rect *bounds, int x, int y, const SpriteTransform *transform) {
+  // nearest neighbour sampling of the pixel centres in the destination box,
+  // mapped back into the source with 16.16 fixed point steps
+  int xl = SDL_max(clip_xl, 0), yl = SDL_max(clip_yl, 0);
+  int xh = SDL_min(clip_xh, screen_width - 1), yh = SDL_min(clip_yh, screen_height - 1);
+  double c = SDL_cos(transform->angle), s = SDL_sin(transform->angle), k = transform->scale;
+  double min_x = 1e30, min_y = 1e30, max_x = -1e30, max_y = -1e30, u, v, fx, fy;
+  Uint32 su, sv, du, dv, bx = (Uint32)bounds->x << 16, by = (Uint32)bounds->y << 16;
+  Uint32 bw = (Uint32)bounds->w << 16, bh = (Uint32)bounds->h << 16;
+  int i, px, py, x1, y1, x2, y2;
+  Uint8 color, *dst;
+
+  if ((bounds->w <= 0) || (bounds->h <= 0) || (k <= 0.0)) return;
+  x += translation.x; y += translation.y;
+  for (i = 0; i < 4; ++i) {
+    u = bounds->x + (i & 1 ? bounds->w : 0) - transform->pivot_x;
+    v = bounds->y + (i & 2 ? bounds->h : 0) - transform->pivot_y;
+    fx = x + k * (c * u - s * v);
+    fy = y + k * (s * u + c * v);
+    min_x = SDL_min(min_x, fx); max_x = SDL_max(max_x, fx);
+    min_y = SDL_min(min_y, fy); max_y = SDL_max(max_y, fy);
+  }
+  // only boxes overlapping the clip rect reach the casts
+  if ((max_x <= xl) || (min_x > xh + 1) || (max_y <= yl) || (min_y > yh + 1)) return;
+  x1 = (int)SDL_max(SDL_floor(min_x), xl); x2 = (int)SDL_min(SDL_ceil(max_x) - 1, xh);
+  y1 = (int)SDL_max(SDL_floor(min_y), yl); y2 = (int)SDL_min(SDL_ceil(max_y) - 1, yh);
+  if ((x1 > x2) || (y1 > y2)) return;
+  pixl_mark_dirty(x1, y1, x2, y2);
+
+  du = (Uint32)pixl_fixed(c / k + 0.5 / 65536.0);
+  dv = (Uint32)pixl_fixed(-s / k + 0.5 / 65536.0);
+  for (py = y1; py <= y2; ++py) {
+    fx = x1 + 0.5 - x;
+    fy = py + 0.5 - y;
+    su = (Uint32)pixl_fixed(transform->pivot_x + (c * fx + s * fy) / k);
+    sv = (Uint32)pixl_fixed(transform->pivot_y + (c * fy - s * fx) / k);
+    dst = screen + py * screen_pitch;
+    for (px = x1; px <= x2; ++px, su += du, sv += dv) {
+      if ((su - bx < bw) && (sv - by < bh)) {
+        color = pixels[(sv >> 16) * pitch + (su >> 16)];
+        if (color != transparent) dst[px] = color;
+      }
+    }
+  }
+}
+
+static void pixl_sprite_cache_remove(lua_State *L, SpriteCacheEntry *entry) {
+  SpriteCacheEntry **link = &sprite_cache[entry->hash & (PIXL_SPRITE_CACHE_BUCKETS - 1)];
+  while (*link != entry) link = &(*link)->next;
+  *link = entry->next;
+  if (entry->newer) entry->newer->older = entry->older; else sprite_cache_newest = entry->older;
+  if (entry->older) entry->older->newer = entry->newer; else sprite_cache_oldest = entry->newer;
+  sprite_cache_size -= entry->size;
+  if (L) {
+    // release the anchored sprite string
+    lua_getfield(L, LUA_REGISTRYINDEX, PIXL_SPRITE_CACHE_ANCHORS);
+    lua_pushnil(L);
+    lua_rawsetp(L, -2, entry);
+    lua_pop(L, 1);
+  }
+  SDL_free(entry);
+}
+
+static void pixl_sprite_cache_trim(lua_State *L, size_t limit) {
+  while (sprite_cache_oldest && (sprite_cache_size > limit)) pixl_sprite_cache_remove(L, sprite_cache_oldest);
+}
+
+static const SpriteImage *pixl_sprite_cache_get(lua_State *L, int index, int w, int h, int transparent) {
+  // decoded sprites are keyed by the identity of the Lua string, which is
+  // anchored in the registry as long as the entry lives
+  const char *key = lua_tostring(L, index);
+  Uint32 hash = (Uint32)(((uintptr_t)key >> 3) ^ ((uintptr_t)w * 31) ^ ((uintptr_t)h * 131) ^ ((Uint32)transparent * 8191));
+  SpriteCacheEntry *entry = sprite_cache[hash & (PIXL_SPRITE_CACHE_BUCKETS - 1)];
+  size_t size;
+
+  for (; entry; entry = entry->next) {
+    if ((entry->key == key) && (entry->image.width == w) && (entry->image.height == h) && (entry->image.transparent == transparent)) break;
+  }
+  if (entry) {
+    ++sprite_cache_hits;
+    if (entry != sprite_cache_newest) {
+      entry->newer->older = entry->older;
+      if (entry->older) entry->older->newer = entry->newer; else sprite_cache_oldest = entry->newer;
+      entry->newer = NULL;
+      entry->older = sprite_cache_newest;
+      sprite_cache_newest->newer = entry;
+      sprite_cache_newest = entry;
+    }
+    return &entry->image;
+  }
+
+  ++sprite_cache_misses;
+  // only strings seen by a recent miss are admitted, one-off strings are
+  // drawn directly and don't push out the entries in use
+  if (sprite_cache_seen[hash & (PIXL_SPRITE_CACHE_SEEN - 1)] != (hash | 1)) {
+    sprite_cache_seen[hash & (PIXL_SPRITE_CACHE_SEEN - 1)] = hash | 1;
+    return NULL;
+  }
+  sprite_cache_seen[hash & (PIXL_SPRITE_CACHE_SEEN - 1)] = 0;
+
+  // the pixels stay in the anchored string and count against the limit
+  size = sizeof(SpriteCacheEntry) + pixl_image_size((const Uint8*)key, w, w, h, transparent) + w * h;
+  if (size > sprite_cache_limit) return NULL;
+  pixl_sprite_cache_trim(L, sprite_cache_limit - size);
+  entry = (SpriteCacheEntry*)SDL_malloc(size);
+  if (!entry) return NULL;
+  pixl_image_init(&entry->image, entry + 1, (const Uint8*)key, w, w, h, transparent);
+  entry->key = key;
+  entry->hash = hash;
+  entry->size = size;
+  entry->next = sprite_cache[hash & (PIXL_SPRITE_CACHE_BUCKETS - 1)];
+  sprite_cache[hash & (PIXL_SPRITE_CACHE_BUCKETS - 1)] = entry;
+  entry->newer = NULL;
+  entry->older = sprite_cache_newest;
+  if (sprite_cache_newest) sprite_cache_newest->newer = entry; else sprite_cache_oldest = entry;
+  sprite_cache_newest = entry;
+  sprite_cache_size += size;
+
+  lua_getfield(L, LUA_REGISTRYINDEX, PIXL_SPRITE_CACHE_ANCHORS);
+  lua_pushvalue(L, index);
+  lua_rawsetp(L, -2, entry);
+  lua_pop(L, 1);
+  return &entry->image;
+}
+
+static Uint32 pixl_utf8(const char **text) {
+  // decode one code point, bytes which are not valid UTF-8 are taken as Latin-1
+  const Uint8 *p = (const Uint8*)*text;
+  Uint32 code = p[0];
+  int i, length = code < 0xC2 ? 1 : code < 0xE0 ? 2 : code < 0xF0 ? 3 : code < 0xF5 ? 4 : 1;
+  if (length > 1) {
+    code &= 0x3F >> (length - 1);
+    for (i = 1; i < length; ++i) {
+      if ((p[i] & 0xC0) != 0x80) break;
+      code = (code << 6) | (p[i] & 0x3F);
+    }
+    // reject truncated, overlong, surrogate and out of range sequences
+    if ((i < length) || (length == 3 && (code < 0x800 || (code >= 0xD800 && code <= 0xDFFF))) || (length == 4 && (code < 0x10000 || code > 0x10FFFF))) {
+      code = p[0];
+      length = 1;
+    }
+  }
+  *text += length;
+  return code;
+}
+
+static int pixl_font_slot(Uint32 code) {
+  // slot of the glyph or the free slot it belongs into
+  int i = (int)((code * 2654435761u) & (Uint32)(font_glyphs_size - 1));
+  while (font_glyphs[i].code && (font_glyphs[i].code != code)) i = (i + 1) & (font_glyphs_size - 1);
+  return i;
+}
+
+static FontGlyph *pixl_font_glyph(Uint32 code, SDL_bool insert) {
+  // open addressing table of the glyphs above Latin-1, NULL if the glyph is
+  // missing or there is no memory to add it
+  FontGlyph *old = font_glyphs;
+  int i, size = font_glyphs_size;
+  if (font_glyphs) {
+    i = pixl_font_slot(code);
+    if (font_glyphs[i].code) return &font_glyphs[i];
+  }
+  if (!insert) return NULL;
+  if ((font_glyphs_count + 1) * 2 > size) {
+    font_glyphs = (FontGlyph*)SDL_calloc(size ? size * 2 : 64, sizeof(FontGlyph));
+    if (!font_glyphs) {
+      font_glyphs = old;
+      return NULL;
+    }
+    font_glyphs_size = size ? size * 2 : 64;
+    for (i = 0; i < size; ++i) {
+      if (old[i].code) font_glyphs[pixl_font_slot(old[i].code)] = old[i];
+    }
+    SDL_free(old);
+  }
+  i = pixl_font_slot(code);
+  font_glyphs[i].code = code;
+  ++font_glyphs_count;
+  return &font_glyphs[i];
+}
+
+static void pixl_glyph_rows(GlyphRow *rows, const Uint8 *bits) {
+  // expand the glyph bits into opaque runs
+  int px, py, mask;
+  GlyphRow *row;
+  for (py = 0; py < 8; ++py) {
+    row = &rows[py];
+    mask = bits[py];
+    row->count = 0;
+    for (px = 0; px < 8; ++px) {
+      if (!(mask & (1 << px))) continue;
+      if ((px == 0) || !(mask & (1 << (px - 1)))) {
+        row->x[row->count] = (Uint8)px;
+        row->length[row->count++] = 0;
+      }
+      ++row->length[row->count - 1];
+    }
+  }
+}
+
+static const GlyphRow *pixl_glyph(Uint32 code) {
+  // the runs of a glyph are built on first use after a change, missing
+  // glyphs are empty
+  static const GlyphRow empty[8];
+  FontGlyph *glyph;
+  if (code < 256) {
+    if (!glyph_rows_valid[code]) {
+      pixl_glyph_rows(glyph_rows[code], font[code]);
+      glyph_rows_valid[code] = SDL_TRUE;
+    }
+    return glyph_rows[code];
+  }
+  glyph = pixl_font_glyph(code, SDL_FALSE);
+  if (!glyph) return empty;
+  if (!glyph->valid) {
+    pixl_glyph_rows(glyph->rows, glyph->bits);
+    glyph->valid = SDL_TRUE;
+  }
+  return glyph->rows;
+}
+
+static int pixl_text_length(const char *text) {
+  int length = 0;
+  while (*text) {
+    pixl_utf8(&text);
+    ++length;
+  }
+  return length;
+}
+
+static void pixl_print(Uint8 color, int x, int y, const char *text) {
+  // characters left of the clip rect are only decoded, the runs of a glyph
+  // are clamped only if it is not completely visible
+  int xl = SDL_max(clip_xl, 0), yl = SDL_max(clip_yl, 0);
+  int xh = SDL_min(clip_xh, screen_width - 1), yh = SDL_min(clip_yh, screen_height - 1);
+  int y1, y2, gx, py, s, sx, sx2, clipped;
+  Uint32 code;
+  const GlyphRow *row;
+  Uint8 *dst;
+
+  x += translation.x; y += translation.y;
+  y1 = SDL_max(y, yl); y2 = SDL_min(y + 7, yh);
+  if ((y1 > y2) || (x > xh)) return;
+
+  for (gx = x; *text && (gx <= xh); gx += 8) {
+    code = (Uint8)*text < 0x80 ? (Uint8)*text++ : pixl_utf8(&text);
+    if (gx + 7 < xl) continue;
+    row = pixl_glyph(code) + (y1 - y);
+    dst = screen + y1 * screen_pitch;
+    clipped = (gx < xl) || (gx + 7 > xh);
+    for (py = y1; py <= y2; ++py, ++row, dst += screen_pitch) {
+      for (s = 0; s < row->count; ++s) {
+        sx = gx + row->x[s];
+        sx2 = sx + row->length[s];
+        if (clipped) {
+          sx = SDL_max(sx, xl);
+          sx2 = SDL_min(sx2, xh + 1);
+        }
+        for (; sx < sx2; ++sx) dst[sx] = color;
+      }
+    }
+  }
+  if (gx - 1 >= xl) pixl_mark_dirty(SDL_max(x, xl), y1, SDL_min(gx - 1, xh), y2);
+}
+
+static int pixl_record(const DrawCommand *command, const void *data, int dx, int dy) {
+  // append the command and its data to the recording, moved by dx, dy
+  int i, size = (int)sizeof(DrawCommand) + pixl_align(command->length);
+  DrawCommand *copy;
+  int *points;
+
+  if (!pixl_reserve((void**)&record_buffer, &record_capacity, record_size + size, 1)) return -1;
+  copy = (DrawCommand*)(record_buffer + record_size);
+  *copy = *command;
+  if ((command->length > 0) && data) SDL_memcpy(copy + 1, data, command->length);
+  record_size += size;
+
+  copy->x1 += dx; copy->y1 += dy;
+  if ((copy->op == PIXL_DRAW_RECT) || (copy->op == PIXL_DRAW_LINE)) {
+    copy->x2 += dx; copy->y2 += dy;
+  } else if (copy->op == PIXL_DRAW_POLYGON) {
+    points = (int*)(copy + 1);
+    for (i = 0; i < copy->length / (int)sizeof(int); i += 2) {
+      points[i] += dx; points[i + 1] += dy;
+    }
+  }
+  return 0;
+}
+
+static Uint8 *pixl_record_image(int x, int y, int w, int h, int transparent, int spans) {
+  // append an image with room for its bounds, rows and spans and return its
+  // pixels, which the caller fills before pixl_record_spans() decodes them
+  DrawCommand command;
+  SDL_zero(command);
+  command.op = PIXL_DRAW_IMAGE;
+  command.x1 = x; command.y1 = y;
+  command.x2 = w; command.y2 = h;
+  command.fill = transparent;
+  command.length = (int)sizeof(SDL_Rect) + pixl_align(w * h) + (h + 1) * (int)sizeof(int) + spans * (int)sizeof(SpriteSpan);
+  if (pixl_record(&command, NULL, 0, 0)) return NULL;
+  return record_buffer + record_size - command.length + sizeof(SDL_Rect);
+}
+
+static void pixl_record_spans(Uint8 *pixels, int w, int h, int transparent) {
+  SpriteImage image;
+  int *rows = (int*)(pixels + pixl_align(w * h));
+  SDL_zero(image);
+  image.width = image.pitch = w;
+  image.height = h;
+  image.transparent = transparent;
+  image.pixels = pixels;
+  pixl_image_spans(&image, rows, (SpriteSpan*)(rows + h + 1), NULL);
+  SDL_memcpy(pixels - sizeof(SDL_Rect), &image.bounds, sizeof(SDL_Rect));
+}
+
+static int pixl_record_sprite(const DrawCommand *command, const Uint8 *data) {
+  // plain sprites are decoded once, so replaying them copies opaque runs
+  int w = command->x2, h = command->y2;
+  Uint8 *pixels;
+  if ((w <= 0) || (h <= 0)) return 0;
+  pixels = pixl_record_image(command->x1, command->y1, w, h, command->fill, pixl_count_spans(data, w, w, h, command->fill));
+  if (!pixels) return -1;
+  SDL_memcpy(pixels, data, w * h);
+  pixl_record_spans(pixels, w, h, command->fill);
+  return 0;
+}
+
+static int pixl_draw(const DrawCommand *command, const void *data) {
+  if (recording) {
+    if (command->op == PIXL_DRAW_SPRITE) return pixl_record_sprite(command, (const Uint8*)data);
+    return pixl_record(command, data, 0, 0);
+  }
+  switch (command->op) {
+    case PIXL_DRAW_POINT:
+      pixl_pset((Uint8)command->color, command->x1, command->y1);
+      break;
+    case PIXL_DRAW_RECT:
+      pixl_rect((Uint8)command->color, command->x1, command->y1, command->x2, command->y2, command->fill);
+      break;
+    case PIXL_DRAW_LINE:
+      pixl_line((Uint8)command->color, command->x1, command->y1, command->x2, command->y2);
+      break;
+    case PIXL_DRAW_SPRITE:
+      pixl_sprite(command->x1, command->y1, command->x2, command->y2, (const Uint8*)data, command->fill);
+      break;
+    case PIXL_DRAW_CIRCLE:
+      pixl_circle((Uint8)command->color, command->x1, command->y1, command->x2, command->fill);
+      break;
+    case PIXL_DRAW_POLYGON:
+      return pixl_polygon((Uint8)command->color, (const int*)data, command->length / (2 * (int)sizeof(int)), command->fill);
+    case PIXL_DRAW_PRINT:
+      pixl_print((Uint8)command->color, command->x1, command->y1, (const char*)data);
+      break;
+    case PIXL_DRAW_TRANSFORM: {
+      SpriteTransform transform;
+      SDL_Rect bounds = { 0, 0, command->x2, command->y2 };
+      SDL_memcpy(&transform, data, sizeof(SpriteTransform));
+      pixl_transform((const Uint8*)data + sizeof(SpriteTransform), command->x2, command->fill, &bounds, command->x1, command->y1, &transform);
+      break;
+    }
+    case PIXL_DRAW_IMAGE: {
+      // bounds, pixels, rows and spans as laid out by pixl_record_image()
+      SpriteImage image;
+      image.width = image.pitch = command->x2;
+      image.height = command->y2;
+      image.transparent = command->fill;
+      image.mask = NULL;
+      image.mask_pitch = 0;
+      SDL_memcpy(&image.bounds, data, sizeof(SDL_Rect));
+      image.pixels = (const Uint8*)data + sizeof(SDL_Rect);
+      image.rows = (const int*)(image.pixels + pixl_align(image.width * image.height));
+      image.spans = (const SpriteSpan*)(image.rows + image.height + 1);
+      pixl_image_draw(&image, command->x1, command->y1, 0);
+      break;
+    }
+  }
+  return 0;
+}
+
+static int pixl_image_record(const SpriteImage *image, int x, int y, int flip, const SpriteTransform *transform) {
+  // record the image with its flipped rows decoded into spans, or with the
+  // transform in front of its pixels
+  DrawCommand command;
+  Uint8 *pixels, *dst;
+  const Uint8 *src;
+  int px, py, w = image->width, h = image->height;
+
+  if (transform) {
+    SDL_zero(command);
+    command.op = PIXL_DRAW_TRANSFORM;
+    command.x1 = x; command.y1 = y;
+    command.x2 = w; command.y2 = h;
+    command.fill = image->transparent;
+    command.length = (int)sizeof(SpriteTransform) + w * h;
+    if (pixl_record(&command, NULL, 0, 0)) return -1;
+    dst = record_buffer + record_size - pixl_align(command.length);
+    SDL_memcpy(dst, transform, sizeof(SpriteTransform));
+    pixels = dst + sizeof(SpriteTransform);
+  } else {
+    // flipping keeps the number of spans, empty images draw nothing
+    if (image->bounds.w <= 0) return 0;
+    pixels = pixl_record_image(x, y, w, h, image->transparent, image->rows[h] - image->rows[0]);
+    if (!pixels) return -1;
+  }
+  for (py = 0, dst = pixels; py < h; ++py, dst += w) {
+    src = image->pixels + (flip & PIXL_FLIP_Y ? h - 1 - py : py) * image->pitch;
+    if (flip & PIXL_FLIP_X) {
+      for (px = 0; px < w; ++px) dst[px] = src[w - 1 - px];
+    } else {
+      SDL_memcpy(dst, src, w);
+    }
+  }
+  if (!transform) pixl_record_spans(pixels, w, h, image->transparent);
+  return 0;
+}
+
+static int pixl_replay(const DisplayList *list, int dx, int dy) {
+  const Uint8 *p = (const Uint8*)(list + 1), *end = p + list->size;
+  const DrawCommand *command;
+  int status = 0;
+
+  if (recording) {
+    for (; (p < end) && !status; p += sizeof(DrawCommand) + pixl_align(command->length)) {
+      command = (const DrawCommand*)p;
+      status = pixl_record(command, command + 1, dx, dy);
+    }
+    return status;
+  }
+
+  translation.x += dx; translation.y += dy;
+  for (; (p < end) && !status; p += sizeof(DrawCommand) + pixl_align(command->length)) {
+    command = (const DrawCommand*)p;
+    status = pixl_draw(command, command + 1);
+  }
+  translation.x -= dx; translation.y -= dy;
+  return status;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Palette Conversion
+//
+////////////////////////////////////////////////////////////////////////////////
+static void pixl_update_palette() {
+  int i;
+  for (i = 0; i < 256; ++i) {
+    const SDL_Color *color = &colors[i];
+    palette[i] = ((Uint32)color->r << 24) | ((Uint32)color->g << 16) | ((Uint32)color->b << 8) | 0xFF;
+  }
+  palette_dirty = SDL_FALSE;
+}
+
+static void pixl_convert_scalar(Uint32 *dst, const Uint8 *src, int count) {
+  for (; count >= 4; count -= 4, dst += 4, src += 4) {
+    dst[0] = palette[src[0]];
+    dst[1] = palette[src[1]];
+    dst[2] = palette[src[2]];
+    dst[3] = palette[src[3]];
+  }
+  while (count-- > 0) *dst++ = palette[*src++];
+}
+
+#if PIXL_X86
+PIXL_TARGET("avx2") static void pixl_convert_avx2(Uint32 *dst, const Uint8 *src, int count) {
+  for (; count >= 16; count -= 16, dst += 16, src += 16) {
+    __m256i lo = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)src));
+    __m256i hi = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + 8)));
+    _mm256_storeu_si256((__m256i*)dst, _mm256_i32gather_epi32((const int*)palette, lo, 4));
+    _mm256_storeu_si256((__m256i*)(dst + 8), _mm256_i32gather_epi32((const int*)palette, hi, 4));
+  }
+  pixl_convert_scalar(dst, src, count);
+}
+#endif // PIXL_X86
+
+static void pixl_convert_job(const ConvertJob *job) {
+  Uint8 *pixels = job->pixels;
+  const Uint8 *src = job->src;
+  int y;
+  for (y = 0; y < job->height; ++y, pixels += job->pitch, src += screen_pitch) {
+    palette_converter((Uint32*)pixels, src, job->width);
+  }
+}
+
+static int pixl_convert_worker(void *data) {
+  ConvertWorker *worker = (ConvertWorker*)data;
+  for (;;) {
+    SDL_SemWait(worker->start);
+    if (worker->quit) break;
+    pixl_convert_job(&worker->job);
+    SDL_SemPost(convert_done);
+  }
+  return 0;
+}
+
+static void pixl_stop_convert_workers() {
+  int i;
+  for (i = 0; i < convert_worker_count; ++i) {
+    ConvertWorker *worker = &convert_workers[i];
+    worker->quit = SDL_TRUE;
+    SDL_SemPost(worker->start);
+    SDL_WaitThread(worker->thread, NULL);
+    SDL_DestroySemaphore(worker->start);
+  }
+  convert_worker_count = 0;
+  if (convert_done) SDL_DestroySemaphore(convert_done);
+  convert_done = NULL;
+}
+
+static void pixl_start_convert_workers(lua_State *L, int count) {
+  int i;
+
+  pixl_stop_convert_workers();
+  if (count <= 0) count = SDL_GetCPUCount();
+  if (count > PIXL_MAX_THREADS) count = PIXL_MAX_THREADS;
+  if (count < 2) return;
+
+  convert_done = SDL_CreateSemaphore(0);
+  if (convert_done == NULL) luaL_error(L, "SDL_CreateSemaphore() failed: %s", SDL_GetError());
+  // the main thread converts a band as well
+  for (i = 0; i < count - 1; ++i) {
+    ConvertWorker *worker = &convert_workers[i];
+    worker->quit = SDL_FALSE;
+    worker->start = SDL_CreateSemaphore(0);
+    if (worker->start == NULL) luaL_error(L, "SDL_CreateSemaphore() failed: %s", SDL_GetError());
+    worker->thread = SDL_CreateThread(pixl_convert_worker, "PiXL Converter", worker);
+    if (worker->thread == NULL) {
+      SDL_DestroySemaphore(worker->start);
+      luaL_error(L, "SDL_CreateThread() failed: %s", SDL_GetError());
+    }
+    ++convert_worker_count;
+  }
+}
+
+static void pixl_convert_rect(Uint8 *pixels, int pitch, const SDL_Rect *rect) {
+  ConvertJob job;
+  const Uint8 *src = screen + (rect->y * screen_pitch) + rect->x;
+  int i, y1, y2;
+  int bands = SDL_min(convert_worker_count + 1, rect->h / PIXL_MIN_BAND_ROWS);
+  if (bands < 1) bands = 1;
+
+  // split the rect into horizontal bands, band 0 is done by the main thread
+  for (i = 1; i < bands; ++i) {
+    ConvertJob *band = &convert_workers[i - 1].job;
+    y1 = (rect->h * i) / bands;
+    y2 = (rect->h * (i + 1)) / bands;
+    band->pixels = pixels + (y1 * pitch);
+    band->src = src + (y1 * screen_pitch);
+    band->pitch = pitch;
+    band->width = rect->w;
+    band->height = y2 - y1;
+    SDL_SemPost(convert_workers[i - 1].start);
+  }
+
+  job.pixels = pixels;
+  job.src = src;
+  job.pitch = pitch;
+  job.width = rect->w;
+  job.height = rect->h / bands;
+  pixl_convert_job(&job);
+
+  for (i = 1; i < bands; ++i) SDL_SemWait(convert_done);
+}
+
+#if PIXL_X86
+static Uint64 pixl_time_converter(PaletteConverter converter, Uint32 *dst, const Uint8 *src, int count) {
+  // best of several runs, so an interrupted one doesn't decide
+  Uint64 best = ~(Uint64)0, start;
+  int i, j;
+  for (i = 0; i < 8; ++i) {
+    start = SDL_GetPerformanceCounter();
+    for (j = 0; j < 16; ++j) converter(dst, src, count);
+    best = SDL_min(best, SDL_GetPerformanceCounter() - start);
+  }
+  return best;
+}
+#endif // PIXL_X86
+
+static void pixl_select_palette_converter() {
+  // gathers are slower than plain loads on many CPUs with AVX2, so the
+  // vector kernel is only used where it measures faster than the scalar one
+  palette_converter = pixl_convert_scalar;
+  #if PIXL_X86
+    if (SDL_HasAVX2()) {
+      Uint32 dst[1024];
+      Uint8 src[1024];
+      int i;
+      for (i = 0; i < 1024; ++i) src[i] = (Uint8)(i * 37);
+      if (pixl_time_converter(pixl_convert_avx2, dst, src, 1024) < pixl_time_converter(pixl_convert_scalar, dst, src, 1024)) {
+        palette_converter = pixl_convert_avx2;
+      }
+    }
+  #endif // PIXL_X86
+}
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -394,6 +1642,7 @@ static int pixl_f_color(lua_State *L) {
       color->r = (Uint8)luaL_checknumber(L, 2);
       color->g = (Uint8)luaL_checknumber(L, 3);
       color->b = (Uint8)luaL_checknumber(L, 4);
+      palette_dirty = SDL_TRUE;
       return 0;
     default:
       return luaL_error(L, "wrong number of arguments");
@@ -413,7 +1662,7 @@ static int pixl_f_resolution(lua_State *L) {
       width = (int)luaL_checkinteger(L, 1);
       height = (int)luaL_checkinteger(L, 2);
       aspect = (double)luaL_optnumber(L, 3, 0.0);
-      luaL_argcheck(L, (width > 0) && (width < PIXL_MAX_SCREEN_HEIGHT), 1, "invalid width");
+      luaL_argcheck(L, (width > 0) && (width < PIXL_MAX_SCREEN_WIDTH), 1, "invalid width");
       luaL_argcheck(L, (height > 0) && (height < PIXL_MAX_SCREEN_HEIGHT), 2, "invalid height");
       pixl_set_resolution(L, width, height, aspect);
       return 0;
@@ -451,182 +1700,1204 @@ static int pixl_f_clip(lua_State *L) {
       int xh = (int)luaL_checknumber(L, 3);
       int yh = (int)luaL_checknumber(L, 4);
 
-      if (xl > xh) pixl_swap(int, xl, xh);
-      if (yl > yh) pixl_swap(int, yl, yh);
+      if (xl > xh) pixl_swap(int, xl, xh);
+      if (yl > yh) pixl_swap(int, yl, yh);
+
+      clip_xl = xl; clip_xh = xh;
+      clip_yl = yl; clip_yh = yh;
+
+      return 0;
+    }
+    default:
+      return luaL_error(L, "wrong number of arguments");
+  }
+}
+
+static int pixl_f_threads(lua_State *L) {
+  lua_Integer count;
+  switch (lua_gettop(L)) {
+    case 0:
+      lua_pushinteger(L, convert_worker_count + 1);
+      lua_pushnumber(L, (lua_Number)convert_time);
+      return 2;
+    case 1:
+      count = luaL_checkinteger(L, 1);
+      luaL_argcheck(L, (count >= 0) && (count <= PIXL_MAX_THREADS), 1, "invalid number of threads");
+      thread_count = (int)count;
+      pixl_start_convert_workers(L, thread_count);
+      return 0;
+    default:
+      return luaL_error(L, "wrong number of arguments");
+  }
+}
+
+static int pixl_f_glyph(lua_State *L) {
+  static const Uint8 empty[8];
+  FontGlyph *glyph;
+  lua_Integer ch = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, (ch >= 0) && (ch <= 0x10FFFF), 1, "invalid glyph");
+  switch (lua_gettop(L)) {
+    case 1:
+      glyph = ch < 256 ? NULL : pixl_font_glyph((Uint32)ch, SDL_FALSE);
+      lua_pushlstring(L, (const char*)(ch < 256 ? font[ch] : glyph ? glyph->bits : empty), 8);
+      return 1;
+    case 2: {
+      size_t length;
+      const Uint8 *data = (const Uint8*)luaL_checklstring(L, 2, &length);
+      luaL_argcheck(L, length == 8, 2, "invalid glyph data length");
+      if (ch < 256) {
+        SDL_memcpy(font[ch], data, 8);
+        glyph_rows_valid[ch] = SDL_FALSE;
+      } else {
+        glyph = pixl_font_glyph((Uint32)ch, SDL_TRUE);
+        if (!glyph) return luaL_error(L, "out of memory");
+        SDL_memcpy(glyph->bits, data, 8);
+        glyph->valid = SDL_FALSE;
+      }
+      return 0;
+    }
+    default:
+      return luaL_error(L, "wrong number of arguments");
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Primitive Drawing Routines
+//
+////////////////////////////////////////////////////////////////////////////////
+static int pixl_f_clear(lua_State *L) {
+  Uint8 color = (Uint8)luaL_optinteger(L, 1, 0);
+  switch (lua_gettop(L)) {
+    case 0:
+    case 1:
+      SDL_memset(screen, color, screen_height * screen_pitch);
+      pixl_mark_dirty_all();
+      return 0;
+    case 5: {
+      int x1 = (int)luaL_checknumber(L, 2);
+      int y1 = (int)luaL_checknumber(L, 3);
+      int x2 = (int)luaL_checknumber(L, 4);
+      int y2 = (int)luaL_checknumber(L, 5);
+
+      if (x1 > x2) pixl_swap(int, x1, x2);
+      if (y1 > y2) pixl_swap(int, y1, y2);
+
+      pixl_fill(color, x1, y1, x2, y2);
+      return 0;
+    }
+    default:
+      return luaL_error(L, "wrong number of arguments");
+  }
+}
+
+static int pixl_f_point(lua_State *L) {
+  DrawCommand command;
+  int x, y;
+  SDL_zero(command);
+  command.op = PIXL_DRAW_POINT;
+  switch (lua_gettop(L)) {
+    case 2:
+      x = (int)luaL_checknumber(L, 1);
+      y = (int)luaL_checknumber(L, 2);
+      lua_pushinteger(L, pixl_pget(x, y));
+      return 1;
+    case 3:
+      command.color = (Uint8)luaL_checkinteger(L, 1);
+      command.x1 = (int)luaL_checknumber(L, 2);
+      command.y1 = (int)luaL_checknumber(L, 3);
+      if (pixl_draw(&command, NULL)) return luaL_error(L, "out of memory");
+      return 0;
+    default:
+      return luaL_error(L, "wrong number of arguments");
+  }
+}
+
+static int pixl_f_rect(lua_State *L) {
+  DrawCommand command;
+  SDL_zero(command);
+  command.op = PIXL_DRAW_RECT;
+  command.color = (Uint8)luaL_checkinteger(L, 1);
+  command.x1 = (int)luaL_checknumber(L, 2);
+  command.y1 = (int)luaL_checknumber(L, 3);
+  command.x2 = (int)luaL_checknumber(L, 4);
+  command.y2 = (int)luaL_checknumber(L, 5);
+  command.fill = lua_toboolean(L, 6);
+  if (pixl_draw(&command, NULL)) return luaL_error(L, "out of memory");
+  return 0;
+}
+
+static int pixl_f_circle(lua_State *L) {
+  DrawCommand command;
+  SDL_zero(command);
+  command.op = PIXL_DRAW_CIRCLE;
+  command.color = (Uint8)luaL_checkinteger(L, 1);
+  command.x1 = (int)luaL_checknumber(L, 2);
+  command.y1 = (int)luaL_checknumber(L, 3);
+  command.x2 = (int)luaL_checknumber(L, 4);
+  command.fill = lua_toboolean(L, 5);
+  if (pixl_draw(&command, NULL)) return luaL_error(L, "out of memory");
+  return 0;
+}
+
+static int pixl_f_line(lua_State *L) {
+  DrawCommand command;
+  SDL_zero(command);
+  command.op = PIXL_DRAW_LINE;
+  command.color = (Uint8)luaL_checkinteger(L, 1);
+  command.x1 = (int)luaL_checknumber(L, 2);
+  command.y1 = (int)luaL_checknumber(L, 3);
+  command.x2 = (int)luaL_checknumber(L, 4);
+  command.y2 = (int)luaL_checknumber(L, 5);
+  if (pixl_draw(&command, NULL)) return luaL_error(L, "out of memory");
+  return 0;
+}
+
+static int pixl_f_triangle(lua_State *L) {
+  DrawCommand command;
+  int i, points[6];
+  SDL_zero(command);
+  command.op = PIXL_DRAW_POLYGON;
+  command.color = (Uint8)luaL_checkinteger(L, 1);
+  for (i = 0; i < 6; ++i) points[i] = (int)luaL_checknumber(L, i + 2);
+  command.fill = lua_toboolean(L, 8);
+  command.length = (int)sizeof(points);
+  if (pixl_draw(&command, points)) return luaL_error(L, "out of memory");
+  return 0;
+}
+
+static int pixl_f_polygon(lua_State *L) {
+  DrawCommand command;
+  int i, isnum, length;
+  SDL_zero(command);
+  command.op = PIXL_DRAW_POLYGON;
+  command.color = (Uint8)luaL_checkinteger(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  length = (int)lua_rawlen(L, 2);
+  luaL_argcheck(L, (length & 1) == 0, 2, "odd number of coordinates");
+  if (!pixl_reserve((void**)&polygon_points, &polygon_points_size, length, sizeof(int))) return luaL_error(L, "out of memory");
+  for (i = 0; i < length; ++i) {
+    lua_rawgeti(L, 2, i + 1);
+    polygon_points[i] = (int)lua_tonumberx(L, -1, &isnum);
+    luaL_argcheck(L, isnum, 2, "coordinates must be numbers");
+    lua_pop(L, 1);
+  }
+  command.fill = lua_toboolean(L, 3);
+  command.length = length * (int)sizeof(int);
+  if (pixl_draw(&command, polygon_points)) return luaL_error(L, "out of memory");
+  return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Advanced Drawing Routines
+//
+////////////////////////////////////////////////////////////////////////////////
+static int pixl_f_print(lua_State *L) {
+  DrawCommand command;
+  const char *text;
+  SDL_zero(command);
+  command.op = PIXL_DRAW_PRINT;
+  command.color = (Uint8)luaL_checkinteger(L, 1);
+  command.x1 = (int)luaL_checknumber(L, 2);
+  command.y1 = (int)luaL_checknumber(L, 3);
+  text = luaL_checkstring(L, 4);
+  command.length = (int)SDL_strlen(text) + 1;
+  if (pixl_draw(&command, text)) return luaL_error(L, "out of memory");
+  return 0;
+}
+
+static int pixl_f_textwidth(lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)pixl_text_length(luaL_checkstring(L, 1)) * 8);
+  return 1;
+}
+
+static int pixl_f_sprite(lua_State *L) {
+  DrawCommand command;
+  size_t length;
+  const Uint8 *data;
+  SDL_zero(command);
+  command.op = PIXL_DRAW_SPRITE;
+  command.x1 = (int)luaL_checkinteger(L, 1);
+  command.y1 = (int)luaL_checkinteger(L, 2);
+  command.x2 = (int)luaL_checkinteger(L, 3);
+  command.y2 = (int)luaL_checkinteger(L, 4);
+  data = (const Uint8*)luaL_checklstring(L, 5, &length);
+  command.fill = (int)luaL_optinteger(L, 6, -1);
+  luaL_argcheck(L, (int)length == command.x2 * command.y2, 5, "invalid sprite data length");
+  if (!recording && (length > 0) && (command.x2 > 0)) {
+    const SpriteImage *image = pixl_sprite_cache_get(L, 5, command.x2, command.y2, command.fill);
+    if (image) {
+      pixl_image_draw(image, command.x1, command.y1, 0);
+      return 0;
+    }
+  }
+  command.length = (int)length;
+  if (pixl_draw(&command, data)) return luaL_error(L, "out of memory");
+  return 0;
+}
+
+#define pixl_read16(p) ((Sint16)((p)[0] | ((p)[1] << 8)))
+
+static int pixl_batch_string(lua_State *L) {
+  // records are string.pack('<BBhh', 1, color, x, y),
+  // ('<BBhhhhB', 2, color, x1, y1, x2, y2, fill), ('<BBhhhh', 3, color, x1, y1, x2, y2)
+  // and ('<BhhHHhs2', 4, x, y, w, h, transparent, data)
+  size_t length;
+  const Uint8 *p = (const Uint8*)lua_tolstring(L, 1, &length);
+  const Uint8 *end = p + length;
+  const Uint8 *data;
+  DrawCommand command;
+  int count = 0;
+
+  SDL_zero(command);
+  for (; p < end; ++count) {
+    command.op = *p;
+    command.length = 0;
+    data = NULL;
+    switch (command.op) {
+      case PIXL_DRAW_POINT:
+        if (end - p < 6) return luaL_error(L, "incomplete batch command %d", count + 1);
+        command.color = p[1];
+        command.x1 = pixl_read16(p + 2);
+        command.y1 = pixl_read16(p + 4);
+        p += 6;
+        break;
+      case PIXL_DRAW_RECT:
+      case PIXL_DRAW_LINE:
+        if (end - p < (command.op == PIXL_DRAW_RECT ? 11 : 10)) return luaL_error(L, "incomplete batch command %d", count + 1);
+        command.color = p[1];
+        command.x1 = pixl_read16(p + 2);
+        command.y1 = pixl_read16(p + 4);
+        command.x2 = pixl_read16(p + 6);
+        command.y2 = pixl_read16(p + 8);
+        if (command.op == PIXL_DRAW_RECT) {
+          command.fill = p[10];
+          p += 11;
+        } else {
+          p += 10;
+        }
+        break;
+      case PIXL_DRAW_SPRITE:
+        if (end - p < 13) return luaL_error(L, "incomplete batch command %d", count + 1);
+        command.x1 = pixl_read16(p + 1);
+        command.y1 = pixl_read16(p + 3);
+        command.x2 = (Uint16)pixl_read16(p + 5);
+        command.y2 = (Uint16)pixl_read16(p + 7);
+        command.fill = pixl_read16(p + 9);
+        command.length = (Uint16)pixl_read16(p + 11);
+        if (command.length != command.x2 * command.y2) return luaL_error(L, "invalid sprite data length in batch command %d", count + 1);
+        if (end - p < 13 + command.length) return luaL_error(L, "incomplete batch command %d", count + 1);
+        data = p + 13;
+        p += 13 + command.length;
+        break;
+      default:
+        return luaL_error(L, "invalid batch command %d", count + 1);
+    }
+    if (pixl_draw(&command, data)) return luaL_error(L, "out of memory");
+  }
+  return count;
+}
+
+static int pixl_batch_number(lua_State *L, int i, int count) {
+  int isnum;
+  lua_Number value;
+  lua_rawgeti(L, 1, i);
+  value = lua_tonumberx(L, -1, &isnum);
+  lua_pop(L, 1);
+  if (!isnum) return luaL_error(L, "invalid value in batch command %d", count + 1);
+  return (int)value;
+}
+
+static int pixl_batch_table(lua_State *L) {
+  // a flat list of commands, each the opcode followed by the arguments of
+  // pixl.point, pixl.rect, pixl.line or pixl.sprite (transparent color is
+  // mandatory, -1 for none)
+  int i = 1, count = 0;
+  int length = (int)lua_rawlen(L, 1);
+  size_t size;
+  const char *data;
+  DrawCommand command;
+
+  SDL_zero(command);
+  for (; i <= length; ++count) {
+    command.op = pixl_batch_number(L, i, count);
+    command.length = 0;
+    data = NULL;
+    switch (command.op) {
+      case PIXL_DRAW_POINT:
+        if (i + 3 > length) return luaL_error(L, "incomplete batch command %d", count + 1);
+        command.color = (Uint8)pixl_batch_number(L, i + 1, count);
+        command.x1 = pixl_batch_number(L, i + 2, count);
+        command.y1 = pixl_batch_number(L, i + 3, count);
+        i += 4;
+        break;
+      case PIXL_DRAW_RECT:
+      case PIXL_DRAW_LINE:
+        if (i + (command.op == PIXL_DRAW_RECT ? 6 : 5) > length) return luaL_error(L, "incomplete batch command %d", count + 1);
+        command.color = (Uint8)pixl_batch_number(L, i + 1, count);
+        command.x1 = pixl_batch_number(L, i + 2, count);
+        command.y1 = pixl_batch_number(L, i + 3, count);
+        command.x2 = pixl_batch_number(L, i + 4, count);
+        command.y2 = pixl_batch_number(L, i + 5, count);
+        if (command.op == PIXL_DRAW_RECT) {
+          lua_rawgeti(L, 1, i + 6);
+          command.fill = lua_toboolean(L, -1);
+          lua_pop(L, 1);
+          i += 7;
+        } else {
+          i += 6;
+        }
+        break;
+      case PIXL_DRAW_SPRITE:
+        if (i + 6 > length) return luaL_error(L, "incomplete batch command %d", count + 1);
+        command.x1 = pixl_batch_number(L, i + 1, count);
+        command.y1 = pixl_batch_number(L, i + 2, count);
+        command.x2 = pixl_batch_number(L, i + 3, count);
+        command.y2 = pixl_batch_number(L, i + 4, count);
+        command.fill = pixl_batch_number(L, i + 6, count);
+        lua_rawgeti(L, 1, i + 5);
+        data = lua_tolstring(L, -1, &size);
+        lua_pop(L, 1);
+        if (!data || (command.x2 < 0) || (command.y2 < 0) || ((Sint64)size != (Sint64)command.x2 * command.y2)) {
+          return luaL_error(L, "invalid sprite data in batch command %d", count + 1);
+        }
+        command.length = (int)size;
+        i += 7;
+        break;
+      default:
+        return luaL_error(L, "invalid batch command %d", count + 1);
+    }
+    if (pixl_draw(&command, data)) return luaL_error(L, "out of memory");
+  }
+  return count;
+}
+
+static int pixl_f_batch(lua_State *L) {
+  int count;
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    count = pixl_batch_string(L);
+  } else {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    count = pixl_batch_table(L);
+  }
+  lua_pushinteger(L, count);
+  return 1;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Display Lists
+//
+////////////////////////////////////////////////////////////////////////////////
+static int pixl_f_record(lua_State *L) {
+  // an unfinished recording, e.g. left behind by an error, is dropped
+  (void)L;
+  recording = SDL_TRUE;
+  record_size = 0;
+  return 0;
+}
+
+static int pixl_f_stop(lua_State *L) {
+  DisplayList *list;
+  if (!recording) return luaL_error(L, "not recording");
+  recording = SDL_FALSE;
+  list = (DisplayList*)lua_newuserdata(L, sizeof(DisplayList) + record_size);
+  list->size = record_size;
+  if (record_size > 0) SDL_memcpy(list + 1, record_buffer, record_size);
+  luaL_setmetatable(L, PIXL_LIST_METATABLE);
+  return 1;
+}
+
+static int pixl_list_draw(lua_State *L) {
+  DisplayList *list = (DisplayList*)luaL_checkudata(L, 1, PIXL_LIST_METATABLE);
+  int dx = (int)luaL_optnumber(L, 2, 0);
+  int dy = (int)luaL_optnumber(L, 3, 0);
+  if (pixl_replay(list, dx, dy)) return luaL_error(L, "out of memory");
+  return 0;
+}
+
+static int pixl_f_spritecache(lua_State *L) {
+  lua_Integer limit;
+  switch (lua_gettop(L)) {
+    case 0:
+      lua_pushinteger(L, (lua_Integer)sprite_cache_hits);
+      lua_pushinteger(L, (lua_Integer)sprite_cache_misses);
+      lua_pushinteger(L, (lua_Integer)sprite_cache_size);
+      lua_pushinteger(L, (lua_Integer)sprite_cache_limit);
+      return 4;
+    case 1:
+      limit = luaL_checkinteger(L, 1);
+      luaL_argcheck(L, limit >= 0, 1, "invalid cache size");
+      sprite_cache_limit = (size_t)limit;
+      pixl_sprite_cache_trim(L, sprite_cache_limit);
+      return 0;
+    default:
+      return luaL_error(L, "wrong number of arguments");
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Sprite Objects
+//
+////////////////////////////////////////////////////////////////////////////////
+static int pixl_f_newsprite(lua_State *L) {
+  SpriteImage *image;
+  size_t length, size;
+  lua_Integer width = luaL_checkinteger(L, 1);
+  lua_Integer height = luaL_checkinteger(L, 2);
+  const Uint8 *data = (const Uint8*)luaL_checklstring(L, 3, &length);
+  int transparent = (int)luaL_optinteger(L, 4, -1);
+  int w, h;
+  luaL_argcheck(L, (width > 0) && (width <= PIXL_MAX_IMAGE_SIZE) && (height > 0) && (height <= PIXL_MAX_IMAGE_SIZE), 1, "invalid sprite size");
+  luaL_argcheck(L, length == (size_t)(width * height), 3, "invalid sprite data length");
+  w = (int)width;
+  h = (int)height;
+  size = pixl_image_size(data, w, w, h, transparent);
+  image = (SpriteImage*)lua_newuserdata(L, sizeof(SpriteImage) + size + w * h);
+  SDL_memcpy((Uint8*)(image + 1) + size, data, w * h);
+  pixl_image_init(image, image + 1, (Uint8*)(image + 1) + size, w, w, h, transparent);
+  luaL_setmetatable(L, PIXL_SPRITE_METATABLE);
+  return 1;
+}
+
+static int pixl_image_draw_args(lua_State *L, const SpriteImage *image, int arg) {
+  // x, y[, flip_x[, flip_y]]
+  int x = (int)luaL_checkinteger(L, arg);
+  int y = (int)luaL_checkinteger(L, arg + 1);
+  int flip = (lua_toboolean(L, arg + 2) ? PIXL_FLIP_X : 0) | (lua_toboolean(L, arg + 3) ? PIXL_FLIP_Y : 0);
+  if (recording) {
+    if (pixl_image_record(image, x, y, flip, NULL)) return luaL_error(L, "out of memory");
+  } else {
+    pixl_image_draw(image, x, y, flip);
+  }
+  return 0;
+}
+
+static int pixl_image_transform_args(lua_State *L, const SpriteImage *image, int arg) {
+  // x, y, angle[, scale[, pivot_x, pivot_y]]
+  SpriteTransform transform;
+  int x = (int)luaL_checkinteger(L, arg);
+  int y = (int)luaL_checkinteger(L, arg + 1);
+  transform.angle = luaL_checknumber(L, arg + 2);
+  transform.scale = luaL_optnumber(L, arg + 3, 1.0);
+  transform.pivot_x = luaL_optnumber(L, arg + 4, image->width * 0.5);
+  transform.pivot_y = luaL_optnumber(L, arg + 5, image->height * 0.5);
+  // 16.16 fixed point has to hold every source position and step
+  luaL_argcheck(L, (image->width < 32768) && (image->height < 32768), 1, "image too large to transform");
+  luaL_argcheck(L, transform.angle - transform.angle == 0.0, arg + 2, "number is not finite");
+  luaL_argcheck(L, (transform.scale >= 1.0 / PIXL_MAX_SCALE) && (transform.scale <= PIXL_MAX_SCALE), arg + 3, "invalid scale");
+  luaL_argcheck(L, transform.pivot_x - transform.pivot_x == 0.0, arg + 4, "number is not finite");
+  luaL_argcheck(L, transform.pivot_y - transform.pivot_y == 0.0, arg + 5, "number is not finite");
+  if (recording) {
+    if (pixl_image_record(image, x, y, 0, &transform)) return luaL_error(L, "out of memory");
+  } else {
+    pixl_transform(image->pixels, image->pitch, image->transparent, &image->bounds, x, y, &transform);
+  }
+  return 0;
+}
+
+static int pixl_sprite_draw(lua_State *L) {
+  return pixl_image_draw_args(L, (const SpriteImage*)luaL_checkudata(L, 1, PIXL_SPRITE_METATABLE), 2);
+}
+
+static int pixl_sprite_transform(lua_State *L) {
+  return pixl_image_transform_args(L, (const SpriteImage*)luaL_checkudata(L, 1, PIXL_SPRITE_METATABLE), 2);
+}
+
+static int pixl_f_newsheet(lua_State *L) {
+  SpriteSheet *sheet;
+  SpriteImage *cells;
+  Uint8 *memory, *pixels;
+  size_t length, size;
+  int i, w, h, cell_w, cell_h, columns, count;
+  const Uint8 *data = (const Uint8*)luaL_checklstring(L, 1, &length);
+  lua_Integer width = luaL_checkinteger(L, 2);
+  lua_Integer height = luaL_checkinteger(L, 3);
+  lua_Integer cell_width = luaL_checkinteger(L, 4);
+  lua_Integer cell_height = luaL_checkinteger(L, 5);
+  int transparent = (int)luaL_optinteger(L, 6, -1);
+  luaL_argcheck(L, (width > 0) && (width <= PIXL_MAX_IMAGE_SIZE) && (height > 0) && (height <= PIXL_MAX_IMAGE_SIZE), 2, "invalid sheet size");
+  luaL_argcheck(L, length == (size_t)(width * height), 1, "invalid sheet data length");
+  // cells are never larger than the sheet, so there is at least one
+  luaL_argcheck(L, (cell_width > 0) && (cell_width <= width) && (cell_height > 0) && (cell_height <= height) &&
+    (width % cell_width == 0) && (height % cell_height == 0), 4, "invalid cell size");
+
+  w = (int)width; h = (int)height;
+  cell_w = (int)cell_width; cell_h = (int)cell_height;
+  columns = w / cell_w;
+  count = columns * (h / cell_h);
+  size = sizeof(SpriteSheet) + count * sizeof(SpriteImage) + w * h;
+  for (i = 0; i < count; ++i) {
+    size += pixl_image_size(data + (i / columns) * cell_h * w + (i % columns) * cell_w, w, cell_w, cell_h, transparent);
+  }
+
+  // one block: header, cells, rows and spans of every cell, sheet pixels
+  sheet = (SpriteSheet*)lua_newuserdata(L, size);
+  sheet->columns = columns;
+  sheet->count = count;
+  cells = (SpriteImage*)(sheet + 1);
+  memory = (Uint8*)(cells + count);
+  pixels = (Uint8*)sheet + size - w * h;
+  SDL_memcpy(pixels, data, w * h);
+  for (i = 0; i < count; ++i) {
+    data = pixels + (i / columns) * cell_h * w + (i % columns) * cell_w;
+    pixl_image_init(&cells[i], memory, data, w, cell_w, cell_h, transparent);
+    memory += pixl_image_size(data, w, cell_w, cell_h, transparent);
+  }
+  luaL_setmetatable(L, PIXL_SHEET_METATABLE);
+  return 1;
+}
+
+static const SpriteImage *pixl_sheet_cell(lua_State *L) {
+  const SpriteSheet *sheet = (const SpriteSheet*)luaL_checkudata(L, 1, PIXL_SHEET_METATABLE);
+  int i = (int)luaL_checkinteger(L, 2);
+  luaL_argcheck(L, (i >= 0) && (i < sheet->count), 2, "invalid cell index");
+  return (const SpriteImage*)(sheet + 1) + i;
+}
+
+static const SpriteImage *pixl_check_image(lua_State *L, int *arg) {
+  // a sprite object or a sheet followed by the cell index
+  const SpriteSheet *sheet = (const SpriteSheet*)luaL_testudata(L, *arg, PIXL_SHEET_METATABLE);
+  int i;
+  if (!sheet) return (const SpriteImage*)luaL_checkudata(L, (*arg)++, PIXL_SPRITE_METATABLE);
+  i = (int)luaL_checkinteger(L, *arg + 1);
+  luaL_argcheck(L, (i >= 0) && (i < sheet->count), *arg + 1, "invalid cell index");
+  *arg += 2;
+  return (const SpriteImage*)(sheet + 1) + i;
+}
+
+static int pixl_f_collide(lua_State *L) {
+  int arg = 1, xa, ya, xb, yb, cx, cy;
+  const SpriteImage *a, *b;
+  a = pixl_check_image(L, &arg);
+  xa = (int)luaL_checkinteger(L, arg++);
+  ya = (int)luaL_checkinteger(L, arg++);
+  b = pixl_check_image(L, &arg);
+  xb = (int)luaL_checkinteger(L, arg++);
+  yb = (int)luaL_checkinteger(L, arg++);
+  if (!pixl_collide(a, xa, ya, b, xb, yb, &cx, &cy)) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  lua_pushboolean(L, 1);
+  lua_pushinteger(L, cx);
+  lua_pushinteger(L, cy);
+  return 3;
+}
+
+static int pixl_sheet_draw(lua_State *L) {
+  return pixl_image_draw_args(L, pixl_sheet_cell(L), 3);
+}
 
-      clip_xl = xl; clip_xh = xh;
-      clip_yl = yl; clip_yh = yh;
+static int pixl_sheet_transform(lua_State *L) {
+  return pixl_image_transform_args(L, pixl_sheet_cell(L), 3);
+}
 
-      return 0;
+static int pixl_sheet_len(lua_State *L) {
+  const SpriteSheet *sheet = (const SpriteSheet*)luaL_checkudata(L, 1, PIXL_SHEET_METATABLE);
+  lua_pushinteger(L, sheet->count);
+  return 1;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Tile Maps
+//
+////////////////////////////////////////////////////////////////////////////////
+static int pixl_floor_div(int a, int b) {
+  return a >= 0 ? a / b : -((b - 1 - a) / b);
+}
+
+static int pixl_f_newmap(lua_State *L) {
+  TileMap *map;
+  Uint16 *tiles;
+  lua_Integer id;
+  int i, isnum;
+  const SpriteSheet *sheet = (const SpriteSheet*)luaL_checkudata(L, 1, PIXL_SHEET_METATABLE);
+  int w = (int)luaL_checkinteger(L, 2);
+  int h = (int)luaL_checkinteger(L, 3);
+  luaL_argcheck(L, (w > 0) && (w <= PIXL_MAX_MAP_SIZE), 2, "invalid map width");
+  luaL_argcheck(L, (h > 0) && (h <= PIXL_MAX_MAP_SIZE), 3, "invalid map height");
+  // tiles are stored as 16 bit ids with the last one meaning empty, the
+  // first cell gives the tile size
+  luaL_argcheck(L, sheet->count > 0, 1, "sheet has no cells");
+  luaL_argcheck(L, sheet->count < PIXL_EMPTY_TILE, 1, "too many cells for a tile map");
+  if (!lua_isnoneornil(L, 4)) luaL_checktype(L, 4, LUA_TTABLE);
+
+  map = (TileMap*)lua_newuserdata(L, sizeof(TileMap) + w * h * sizeof(Uint16));
+  map->width = w;
+  map->height = h;
+  map->sheet = sheet;
+  tiles = (Uint16*)(map + 1);
+  for (i = 0; i < w * h; ++i) {
+    tiles[i] = PIXL_EMPTY_TILE;
+    if (lua_istable(L, 4)) {
+      if (lua_rawgeti(L, 4, i + 1) != LUA_TNIL) {
+        id = lua_tointegerx(L, -1, &isnum);
+        luaL_argcheck(L, isnum && (id >= -1) && (id < sheet->count), 4, "invalid cell index");
+        if (id >= 0) tiles[i] = (Uint16)id;
+      }
+      lua_pop(L, 1);
     }
-    default:
-      return luaL_error(L, "wrong number of arguments");
   }
+  // the map keeps its sheet alive
+  lua_pushvalue(L, 1);
+  lua_setuservalue(L, -2);
+  luaL_setmetatable(L, PIXL_MAP_METATABLE);
+  return 1;
 }
 
-static int pixl_f_glyph(lua_State *L) {
-  int ch = (int)luaL_checkinteger(L, 1);
-  luaL_argcheck(L, (ch >= 0) && (ch < 128), 1, "invalid glyph");
-  switch (lua_gettop(L)) {
-    case 1:
-      lua_pushlstring(L, (const char*)&font[ch][0], 8);
-      return 1;
-    case 2: {
-      int i;
-      size_t length;
-      const Uint8 *data = (const Uint8*)luaL_checklstring(L, 2, &length);
-      luaL_argcheck(L, length == 8, 2, "invalid glyph data length");
-      for (i = 0; i < 8; ++i) font[ch][i] = *data++;
-      return 0;
+static Uint16 *pixl_map_tile(lua_State *L, TileMap **map) {
+  int x, y;
+  *map = (TileMap*)luaL_checkudata(L, 1, PIXL_MAP_METATABLE);
+  x = (int)luaL_checkinteger(L, 2);
+  y = (int)luaL_checkinteger(L, 3);
+  luaL_argcheck(L, (x >= 0) && (x < (*map)->width) && (y >= 0) && (y < (*map)->height), 2, "invalid tile position");
+  return (Uint16*)(*map + 1) + y * (*map)->width + x;
+}
+
+static int pixl_map_get(lua_State *L) {
+  TileMap *map;
+  Uint16 tile = *pixl_map_tile(L, &map);
+  lua_pushinteger(L, tile == PIXL_EMPTY_TILE ? -1 : tile);
+  return 1;
+}
+
+static int pixl_map_set(lua_State *L) {
+  TileMap *map;
+  Uint16 *tile = pixl_map_tile(L, &map);
+  lua_Integer id = luaL_checkinteger(L, 4);
+  luaL_argcheck(L, (id >= -1) && (id < map->sheet->count), 4, "invalid cell index");
+  *tile = id < 0 ? PIXL_EMPTY_TILE : (Uint16)id;
+  return 0;
+}
+
+static int pixl_map_draw(lua_State *L) {
+  // only the tiles overlapping the clip rect are visited, empty and fully
+  // transparent cells are skipped by their bounds
+  const TileMap *map = (const TileMap*)luaL_checkudata(L, 1, PIXL_MAP_METATABLE);
+  int camera_x = (int)luaL_checknumber(L, 2);
+  int camera_y = (int)luaL_checknumber(L, 3);
+  const SpriteImage *cells = (const SpriteImage*)(map->sheet + 1), *image;
+  const Uint16 *tiles = (const Uint16*)(map + 1), *row;
+  int w = cells->width, h = cells->height;
+  int x1 = pixl_floor_div(SDL_max(clip_xl, 0) - translation.x + camera_x, w);
+  int y1 = pixl_floor_div(SDL_max(clip_yl, 0) - translation.y + camera_y, h);
+  int x2 = pixl_floor_div(SDL_min(clip_xh, screen_width - 1) - translation.x + camera_x, w);
+  int y2 = pixl_floor_div(SDL_min(clip_yh, screen_height - 1) - translation.y + camera_y, h);
+  int x, y;
+
+  x1 = SDL_max(x1, 0); x2 = SDL_min(x2, map->width - 1);
+  y1 = SDL_max(y1, 0); y2 = SDL_min(y2, map->height - 1);
+  for (y = y1; y <= y2; ++y) {
+    row = tiles + y * map->width;
+    for (x = x1; x <= x2; ++x) {
+      if (row[x] >= map->sheet->count) continue;
+      image = cells + row[x];
+      if (recording) {
+        if (pixl_image_record(image, x * w - camera_x, y * h - camera_y, 0, NULL)) return luaL_error(L, "out of memory");
+      } else {
+        pixl_image_draw(image, x * w - camera_x, y * h - camera_y, 0);
+      }
     }
-    default:
-      return luaL_error(L, "wrong number of arguments");
   }
+  return 0;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  Primitive Drawing Routines
+//  Spatial Grids
 //
 ////////////////////////////////////////////////////////////////////////////////
-static int pixl_f_clear(lua_State *L) {
-  Uint8 color = (Uint8)luaL_optinteger(L, 1, 0);
-  SDL_memset(screen, color, sizeof(screen));
-  return 0;
+static int pixl_grid_cell(const SpatialGrid *grid, double v) {
+  v = SDL_floor(v / grid->cell_size);
+  return (int)SDL_max(SDL_min(v, PIXL_GRID_CELL_LIMIT), -PIXL_GRID_CELL_LIMIT);
 }
 
-static int pixl_f_point(lua_State *L) {
-  Uint8 color;
-  int x, y;
-  switch (lua_gettop(L)) {
-    case 2:
-      x = (int)luaL_checknumber(L, 1);
-      y = (int)luaL_checknumber(L, 2);
-      lua_pushinteger(L, pixl_pget(x, y));
-      return 1;
-    case 3:
-      color = (Uint8)luaL_checkinteger(L, 1);
-      x = (int)luaL_checknumber(L, 2);
-      y = (int)luaL_checknumber(L, 3);
-      pixl_pset(color, x, y);
-      return 0;
-    default:
-      return luaL_error(L, "wrong number of arguments");
-  }
+static int pixl_grid_hash(const SpatialGrid *grid, int cx, int cy) {
+  return (int)(((Uint32)cx * 73856093u ^ (Uint32)cy * 19349663u) & (Uint32)(grid->buckets - 1));
 }
 
-static int pixl_f_rect(lua_State *L) {
-  int x, y;
-  Uint8 color = (Uint8)luaL_checkinteger(L, 1);
-  int x1 = (int)luaL_checknumber(L, 2);
-  int y1 = (int)luaL_checknumber(L, 3);
-  int x2 = (int)luaL_checknumber(L, 4);
-  int y2 = (int)luaL_checknumber(L, 5);
-  int fill = lua_toboolean(L, 6);
+static double pixl_grid_cells(const SpatialGrid *grid, const GridBox *box, int *cx1, int *cy1, int *cx2, int *cy2) {
+  // the cells covered by the box and their number
+  *cx1 = pixl_grid_cell(grid, box->x); *cx2 = pixl_grid_cell(grid, box->x + box->w);
+  *cy1 = pixl_grid_cell(grid, box->y); *cy2 = pixl_grid_cell(grid, box->y + box->h);
+  return ((double)*cx2 - *cx1 + 1.0) * ((double)*cy2 - *cy1 + 1.0);
+}
 
-  if (x1 > x2) pixl_swap(int, x1, x2);
-  if (y1 > y2) pixl_swap(int, y1, y2);
+static SDL_bool pixl_grid_overlap(const GridBox *a, const GridBox *b) {
+  return (a->x < b->x + b->w) && (b->x < a->x + a->w) && (a->y < b->y + b->h) && (b->y < a->y + a->h);
+}
 
-  if (fill) {
-    for (x = x1; x <= x2; ++x) {
-      for (y = y1; y <= y2; ++y) {
-        pixl_pset(color, x, y);
-      }
+static SDL_bool pixl_grid_build(SpatialGrid *grid) {
+  // counting sort of the boxes into the buckets of every cell they cover, a
+  // box is only stored once per bucket even if several of its cells collide,
+  // boxes covering more than PIXL_GRID_LARGE_CELLS go into the large list
+  int id, b, cx, cy, cx1, cy1, cx2, cy2, total = 0;
+  GridBox *box;
+
+  grid->buckets = 64;
+  while (grid->buckets < grid->count * 2) grid->buckets *= 2;
+  if (!pixl_reserve((void**)&grid->starts, &grid->starts_size, grid->buckets + 1, sizeof(int))) return SDL_FALSE;
+  if (!pixl_reserve((void**)&grid->ends, &grid->ends_size, grid->buckets, sizeof(int))) return SDL_FALSE;
+  SDL_memset(grid->starts, 0, (grid->buckets + 1) * sizeof(int));
+
+  grid->large_count = 0;
+  for (id = 0; id < grid->id_limit; ++id) {
+    box = &grid->boxes[id];
+    if (!box->active) continue;
+    box->large = pixl_grid_cells(grid, box, &cx1, &cy1, &cx2, &cy2) > PIXL_GRID_LARGE_CELLS;
+    if (box->large) {
+      if (!pixl_reserve((void**)&grid->large, &grid->large_size, grid->large_count + 1, sizeof(int))) return SDL_FALSE;
+      grid->large[grid->large_count++] = id;
+      continue;
     }
-  } else {
-    for (x = x1; x <= x2; ++x) {
-      pixl_pset(color, x, y1);
-      pixl_pset(color, x, y2);
+    for (cy = cy1; cy <= cy2; ++cy) {
+      for (cx = cx1; cx <= cx2; ++cx) ++grid->starts[pixl_grid_hash(grid, cx, cy)];
     }
-    for (y = y1 + 1; y <= y2 - 1; ++y) {
-      pixl_pset(color, x1, y);
-      pixl_pset(color, x2, y);
+  }
+  for (b = 0; b <= grid->buckets; ++b) {
+    int count = grid->starts[b];
+    grid->starts[b] = total;
+    if (b < grid->buckets) grid->ends[b] = total;
+    total += count;
+  }
+  if (!pixl_reserve((void**)&grid->items, &grid->items_size, SDL_max(total, 1), sizeof(int))) return SDL_FALSE;
+
+  for (id = 0; id < grid->id_limit; ++id) {
+    box = &grid->boxes[id];
+    if (!box->active || box->large) continue;
+    pixl_grid_cells(grid, box, &cx1, &cy1, &cx2, &cy2);
+    for (cy = cy1; cy <= cy2; ++cy) {
+      for (cx = cx1; cx <= cx2; ++cx) {
+        b = pixl_grid_hash(grid, cx, cy);
+        if ((grid->ends[b] > grid->starts[b]) && (grid->items[grid->ends[b] - 1] == id)) continue;
+        grid->items[grid->ends[b]++] = id;
+      }
     }
   }
+  grid->dirty = SDL_FALSE;
+  return SDL_TRUE;
+}
+
+static double pixl_grid_number(lua_State *L, int arg) {
+  double v = luaL_checknumber(L, arg);
+  luaL_argcheck(L, v - v == 0.0, arg, "number is not finite");
+  return v;
+}
+
+static SpatialGrid *pixl_check_grid(lua_State *L) {
+  SpatialGrid *grid = (SpatialGrid*)luaL_checkudata(L, 1, PIXL_GRID_METATABLE);
+  if (grid->dirty && !pixl_grid_build(grid)) luaL_error(L, "out of memory");
+  return grid;
+}
+
+static int pixl_grid_result(lua_State *L, int arg, int count) {
+  // clear the entries left over from the last use of the result table
+  for (++count; lua_rawgeti(L, arg, count) != LUA_TNIL; ++count) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_rawseti(L, arg, count);
+  }
+  lua_pop(L, 1);
+  lua_pushvalue(L, arg);
+  return 1;
+}
+
+static int pixl_f_newgrid(lua_State *L) {
+  SpatialGrid *grid;
+  double cell_size = luaL_checknumber(L, 1);
+  luaL_argcheck(L, cell_size > 0.0, 1, "invalid cell size");
+  grid = (SpatialGrid*)lua_newuserdata(L, sizeof(SpatialGrid));
+  SDL_zerop(grid);
+  grid->cell_size = cell_size;
+  grid->dirty = SDL_TRUE;
+  luaL_setmetatable(L, PIXL_GRID_METATABLE);
+  return 1;
+}
+
+static GridBox *pixl_grid_box(lua_State *L, SpatialGrid *grid, SDL_bool insert) {
+  int id, size = grid->boxes_size;
+  lua_Integer value = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, (value >= 0) && (value < PIXL_GRID_ID_LIMIT), 2, "invalid id");
+  id = (int)value;
+  if (!insert) {
+    if ((id >= grid->id_limit) || !grid->boxes[id].active) luaL_argerror(L, 2, "id is not in the grid");
+    return &grid->boxes[id];
+  }
+  if (!pixl_reserve((void**)&grid->boxes, &grid->boxes_size, id + 1, sizeof(GridBox))) luaL_error(L, "out of memory");
+  if (grid->boxes_size > size) SDL_memset(grid->boxes + size, 0, (grid->boxes_size - size) * sizeof(GridBox));
+  grid->id_limit = SDL_max(grid->id_limit, id + 1);
+  if (!grid->boxes[id].active) {
+    grid->boxes[id].active = 1;
+    ++grid->count;
+  }
+  return &grid->boxes[id];
+}
+
+static int pixl_grid_insert(lua_State *L) {
+  SpatialGrid *grid = (SpatialGrid*)luaL_checkudata(L, 1, PIXL_GRID_METATABLE);
+  double x = pixl_grid_number(L, 3);
+  double y = pixl_grid_number(L, 4);
+  double w = pixl_grid_number(L, 5);
+  double h = pixl_grid_number(L, 6);
+  GridBox *box;
+  luaL_argcheck(L, (w >= 0.0) && (h >= 0.0), 5, "invalid box size");
+  box = pixl_grid_box(L, grid, SDL_TRUE);
+  box->x = x; box->y = y;
+  box->w = w; box->h = h;
+  grid->dirty = SDL_TRUE;
   return 0;
 }
 
-static int pixl_f_circle(lua_State *L) {
-  int rx, ry, dist;
-  Uint8 color = (Uint8)luaL_checkinteger(L, 1);
-  int x = (int)luaL_checknumber(L, 2);
-  int y = (int)luaL_checknumber(L, 3);
-  int radius = (int)luaL_checknumber(L, 4);
-  int r0sq = lua_toboolean(L, 5) ? 0 : (radius - 1) * (radius - 1);
-  int r1sq = radius * radius;
-
-  for (rx = -radius; rx <= radius; ++rx) {
-    for (ry = -radius; ry <= radius; ++ry) {
-      dist = (rx * rx) + (ry * ry);
-      if ((dist >= r0sq) && (dist <= r1sq)) pixl_pset(color, x + rx, y + ry);
+static int pixl_grid_move(lua_State *L) {
+  SpatialGrid *grid = (SpatialGrid*)luaL_checkudata(L, 1, PIXL_GRID_METATABLE);
+  GridBox *box = pixl_grid_box(L, grid, SDL_FALSE);
+  double x = pixl_grid_number(L, 3);
+  double y = pixl_grid_number(L, 4);
+  double w = lua_isnoneornil(L, 5) ? box->w : pixl_grid_number(L, 5);
+  double h = lua_isnoneornil(L, 6) ? box->h : pixl_grid_number(L, 6);
+  luaL_argcheck(L, (w >= 0.0) && (h >= 0.0), 5, "invalid box size");
+  box->x = x; box->y = y;
+  box->w = w; box->h = h;
+  grid->dirty = SDL_TRUE;
+  return 0;
+}
+
+static int pixl_grid_remove(lua_State *L) {
+  SpatialGrid *grid = (SpatialGrid*)luaL_checkudata(L, 1, PIXL_GRID_METATABLE);
+  pixl_grid_box(L, grid, SDL_FALSE)->active = 0;
+  --grid->count;
+  grid->dirty = SDL_TRUE;
+  return 0;
+}
+
+static int pixl_grid_query(lua_State *L) {
+  // every box is returned once, marked with the number of the query, areas
+  // covering more cells than there are buckets check every box instead
+  SpatialGrid *grid = pixl_check_grid(L);
+  GridBox area, *box;
+  int i, id, cx, cy, cx1, cy1, cx2, cy2, count = 0;
+  area.x = pixl_grid_number(L, 2);
+  area.y = pixl_grid_number(L, 3);
+  area.w = pixl_grid_number(L, 4);
+  area.h = pixl_grid_number(L, 5);
+  if (lua_isnoneornil(L, 6)) {
+    lua_settop(L, 5);
+    lua_newtable(L);
+  } else {
+    luaL_checktype(L, 6, LUA_TTABLE);
+  }
+
+  if (++grid->stamp == 0) {
+    for (id = 0; id < grid->id_limit; ++id) grid->boxes[id].stamp = 0;
+    grid->stamp = 1;
+  }
+  if (pixl_grid_cells(grid, &area, &cx1, &cy1, &cx2, &cy2) > grid->buckets) {
+    for (id = 0; id < grid->id_limit; ++id) {
+      if (!grid->boxes[id].active || !pixl_grid_overlap(&area, &grid->boxes[id])) continue;
+      lua_pushinteger(L, id);
+      lua_rawseti(L, 6, ++count);
+    }
+  } else {
+    for (cy = cy1; cy <= cy2; ++cy) {
+      for (cx = cx1; cx <= cx2; ++cx) {
+        int b = pixl_grid_hash(grid, cx, cy);
+        for (i = grid->starts[b]; i < grid->ends[b]; ++i) {
+          box = &grid->boxes[grid->items[i]];
+          if ((box->stamp == grid->stamp) || !pixl_grid_overlap(&area, box)) continue;
+          box->stamp = grid->stamp;
+          lua_pushinteger(L, grid->items[i]);
+          lua_rawseti(L, 6, ++count);
+        }
+      }
+    }
+    for (i = 0; i < grid->large_count; ++i) {
+      if (!pixl_grid_overlap(&area, &grid->boxes[grid->large[i]])) continue;
+      lua_pushinteger(L, grid->large[i]);
+      lua_rawseti(L, 6, ++count);
     }
   }
-  return 0;
+  pixl_grid_result(L, 6, count);
+  lua_pushinteger(L, count);
+  return 2;
 }
 
-static int pixl_f_line(lua_State *L) {
-  Uint8 color = (Uint8)luaL_checkinteger(L, 1);
-  int x1 = (int)luaL_checknumber(L, 2);
-  int y1 = (int)luaL_checknumber(L, 3);
-  int x2 = (int)luaL_checknumber(L, 4);
-  int y2 = (int)luaL_checknumber(L, 5);
-  int dx = SDL_abs(x2 - x1), sx = x1 < x2 ? 1 : -1;
-  int dy = SDL_abs(y2 - y1), sy = y1 < y2 ? 1 : -1;
-  int err = (dx > dy ? dx : -dy) / 2, e2;
-  for (;;) {
-    pixl_pset(color, x1, y1);
-    if (x1 == x2 && y1 == y2) break;
-    e2 = err;
-    if (e2 > -dx) { err -= dy; x1 += sx; }
-    if (e2 < dy) { err += dx; y1 += sy; }
+static int pixl_grid_pairs(lua_State *L) {
+  // a pair is only reported by the bucket of the top left cell of its overlap,
+  // large boxes are checked against every other box
+  SpatialGrid *grid = pixl_check_grid(L);
+  const GridBox *a, *b;
+  int bucket, i, j, id, count = 0;
+  if (lua_isnoneornil(L, 2)) {
+    lua_settop(L, 1);
+    lua_newtable(L);
+  } else {
+    luaL_checktype(L, 2, LUA_TTABLE);
   }
-  return 0;
+
+  for (bucket = 0; bucket < grid->buckets; ++bucket) {
+    for (i = grid->starts[bucket]; i < grid->ends[bucket]; ++i) {
+      a = &grid->boxes[grid->items[i]];
+      for (j = i + 1; j < grid->ends[bucket]; ++j) {
+        b = &grid->boxes[grid->items[j]];
+        if (!pixl_grid_overlap(a, b)) continue;
+        if (pixl_grid_hash(grid, pixl_grid_cell(grid, SDL_max(a->x, b->x)), pixl_grid_cell(grid, SDL_max(a->y, b->y))) != bucket) continue;
+        lua_pushinteger(L, grid->items[i]);
+        lua_rawseti(L, 2, ++count);
+        lua_pushinteger(L, grid->items[j]);
+        lua_rawseti(L, 2, ++count);
+      }
+    }
+  }
+  for (i = 0; i < grid->large_count; ++i) {
+    a = &grid->boxes[grid->large[i]];
+    for (id = 0; id < grid->id_limit; ++id) {
+      b = &grid->boxes[id];
+      if (!b->active || (id == grid->large[i]) || (b->large && (id < grid->large[i])) || !pixl_grid_overlap(a, b)) continue;
+      lua_pushinteger(L, grid->large[i]);
+      lua_rawseti(L, 2, ++count);
+      lua_pushinteger(L, id);
+      lua_rawseti(L, 2, ++count);
+    }
+  }
+  pixl_grid_result(L, 2, count);
+  lua_pushinteger(L, count / 2);
+  return 2;
 }
 
+static int pixl_grid_gc(lua_State *L) {
+  SpatialGrid *grid = (SpatialGrid*)luaL_checkudata(L, 1, PIXL_GRID_METATABLE);
+  SDL_free(grid->boxes);
+  SDL_free(grid->starts);
+  SDL_free(grid->ends);
+  SDL_free(grid->items);
+  SDL_free(grid->large);
+  SDL_zerop(grid);
+  return 0;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  Advanced Drawing Routines
+//  Font Objects
 //
 ////////////////////////////////////////////////////////////////////////////////
-static int pixl_f_print(lua_State *L) {
-  int px, py, mask;
-  Uint8 color = (Uint8)luaL_checkinteger(L, 1);
-  int x = (int)luaL_checknumber(L, 2);
-  int y = (int)luaL_checknumber(L, 3);
-  const char *text = luaL_checkstring(L, 4);
-
-  for (; *text; ++text, x += 8) {
-    for (py = 0; py < 8; ++py) {
-      mask = font[*text & 127][py];
-      for (px = 0; px < 8; ++px) {
-        if (mask & (1 << px)) pixl_pset(color, x + px, y + py);
+static int pixl_compare_font_chars(const void *a, const void *b) {
+  Uint32 ca = ((const FontChar*)a)->code, cb = ((const FontChar*)b)->code;
+  return ca < cb ? -1 : ca > cb ? 1 : 0;
+}
+
+static int pixl_bitmap_index(const BitmapFont *bitmap, Uint32 code) {
+  // glyph of the code point or -1, Latin-1 is looked up directly
+  const FontChar *chars = (const FontChar*)(bitmap + 1);
+  int lo = 0, hi = bitmap->extra - 1, mid;
+  if (code < 256) return bitmap->latin1[code];
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (chars[mid].code == code) return chars[mid].index;
+    if (chars[mid].code < code) lo = mid + 1; else hi = mid - 1;
+  }
+  return -1;
+}
+
+static void pixl_bitmap_print(const BitmapFont *bitmap, Uint8 color, int x, int y, const char *text) {
+  // the same span loop as pixl_print(), every glyph moves on by its advance
+  int xl = SDL_max(clip_xl, 0), yl = SDL_max(clip_yl, 0);
+  int xh = SDL_min(clip_xh, screen_width - 1), yh = SDL_min(clip_yh, screen_height - 1);
+  int w = bitmap->width, h = bitmap->height, right = -1;
+  int y1, y2, g, gx, py, sx, sx2, advance, clipped;
+  const int *advances = (const int*)((const FontChar*)(bitmap + 1) + bitmap->extra);
+  const int *rows = advances + bitmap->count, *row;
+  const SpriteSpan *spans = (const SpriteSpan*)(rows + bitmap->count * h + 1), *span, *last;
+  Uint32 code;
+  Uint8 *dst;
+
+  x += translation.x; y += translation.y;
+  y1 = SDL_max(y, yl); y2 = SDL_min(y + h - 1, yh);
+  if ((y1 > y2) || (x > xh)) return;
+
+  for (gx = x; *text && (gx <= xh); gx += advance) {
+    code = (Uint8)*text < 0x80 ? (Uint8)*text++ : pixl_utf8(&text);
+    g = pixl_bitmap_index(bitmap, code);
+    advance = g < 0 ? w : advances[g];
+    if ((g < 0) || (gx + w - 1 < xl)) continue;
+    row = rows + g * h + (y1 - y);
+    dst = screen + y1 * screen_pitch;
+    clipped = (gx < xl) || (gx + w - 1 > xh);
+    right = gx + w - 1;
+    for (py = y1; py <= y2; ++py, ++row, dst += screen_pitch) {
+      last = spans + row[1];
+      for (span = spans + row[0]; span < last; ++span) {
+        sx = gx + span->x;
+        sx2 = sx + span->length;
+        if (clipped) {
+          sx = SDL_max(sx, xl);
+          sx2 = SDL_min(sx2, xh + 1);
+        }
+        for (; sx < sx2; ++sx) dst[sx] = color;
+      }
+    }
+  }
+  if (right >= SDL_max(x, xl)) pixl_mark_dirty(SDL_max(x, xl), y1, SDL_min(right, xh), y2);
+}
+
+static int pixl_bitmap_record(const BitmapFont *bitmap, Uint8 color, int x, int y, const char *text) {
+  // record every glyph as a decoded image, the font itself can't be kept
+  // alive by a display list
+  int g, py, w = bitmap->width, h = bitmap->height;
+  const int *advances = (const int*)((const FontChar*)(bitmap + 1) + bitmap->extra);
+  const int *rows = advances + bitmap->count;
+  const SpriteSpan *spans = (const SpriteSpan*)(rows + bitmap->count * h + 1), *span;
+  Uint8 *pixels, *dst;
+
+  for (; *text; x += g < 0 ? w : advances[g]) {
+    g = pixl_bitmap_index(bitmap, pixl_utf8(&text));
+    if ((g < 0) || (rows[g * h] == rows[(g + 1) * h])) continue;
+    pixels = pixl_record_image(x, y, w, h, color ^ 1, rows[(g + 1) * h] - rows[g * h]);
+    if (!pixels) return -1;
+    SDL_memset(pixels, color ^ 1, w * h);
+    for (py = 0, dst = pixels; py < h; ++py, dst += w) {
+      for (span = spans + rows[g * h + py]; span < spans + rows[g * h + py + 1]; ++span) {
+        SDL_memset(dst + span->x, color, span->length);
       }
     }
+    pixl_record_spans(pixels, w, h, color ^ 1);
   }
   return 0;
 }
 
-static int pixl_f_sprite(lua_State *L) {
-  int px, py;
+static int pixl_f_newfont(lua_State *L) {
+  BitmapFont *bitmap;
+  FontChar *chars;
+  SpriteSpan *spans;
+  Uint32 code;
   size_t length;
-  int x = (int)luaL_checkinteger(L, 1);
-  int y = (int)luaL_checkinteger(L, 2);
-  int w = (int)luaL_checkinteger(L, 3);
-  int h = (int)luaL_checkinteger(L, 4);
-  const Uint8 *data = (const Uint8*)luaL_checklstring(L, 5, &length);
-  int transparent = (int)luaL_optinteger(L, 6, -1);
-  luaL_argcheck(L, (int)length == w * h, 5, "invalid sprite data length");
-  for (py = 0; py < h; ++py) {
-    for (px = 0; px < w; ++px) {
-      Uint8 color = *data++;
-      if (color != transparent) pixl_pset(color, x + px, y + py);
+  int i, g, px, py, count, extra = 0, total = 0, *advances, *rows;
+  const char *text = NULL, *p;
+  const Uint8 *data = (const Uint8*)luaL_checklstring(L, 1, &length), *src;
+  lua_Integer w = luaL_checkinteger(L, 2);
+  lua_Integer h = luaL_checkinteger(L, 3);
+  lua_Integer first = 32, advance;
+  luaL_argcheck(L, (w > 0) && (w <= PIXL_MAX_GLYPH_SIZE) && (h > 0) && (h <= PIXL_MAX_GLYPH_SIZE), 2, "invalid glyph size");
+  luaL_argcheck(L, (length > 0) && (length % (w * h) == 0), 1, "invalid font data length");
+  count = (int)(length / (w * h));
+
+  // glyphs are consecutive code points or listed in a UTF-8 string
+  if (lua_type(L, 4) == LUA_TSTRING) {
+    text = lua_tostring(L, 4);
+    luaL_argcheck(L, pixl_text_length(text) == count, 4, "invalid number of characters");
+    for (p = text; *p; ) {
+      if (pixl_utf8(&p) >= 256) ++extra;
+    }
+  } else {
+    first = luaL_optinteger(L, 4, 32);
+    luaL_argcheck(L, (first >= 0) && (first + count - 1 <= 0x10FFFF), 4, "invalid first character");
+    extra = (int)(SDL_max(first + count, 256) - SDL_max(first, 256));
+  }
+  if (!lua_isnoneornil(L, 5) && !lua_istable(L, 5)) {
+    advance = luaL_checkinteger(L, 5);
+    luaL_argcheck(L, (advance >= 0) && (advance <= PIXL_MAX_GLYPH_SIZE), 5, "invalid advance");
+  }
+  lua_settop(L, 5);
+
+  // every row of the strip is count glyphs wide
+  for (g = 0; g < count; ++g) {
+    for (py = 0; py < h; ++py) {
+      src = data + py * count * w + g * w;
+      for (px = 0; px < w; ++px) {
+        if (src[px] && ((px == 0) || !src[px - 1])) ++total;
+      }
+    }
+  }
+
+  // one block: header, sorted code points above Latin-1, advances, row
+  // index and spans of every glyph
+  bitmap = (BitmapFont*)lua_newuserdata(L, sizeof(BitmapFont) + extra * sizeof(FontChar) +
+    (count + count * h + 1) * sizeof(int) + total * sizeof(SpriteSpan));
+  bitmap->width = (int)w;
+  bitmap->height = (int)h;
+  bitmap->count = count;
+  bitmap->extra = extra;
+  for (i = 0; i < 256; ++i) bitmap->latin1[i] = -1;
+  chars = (FontChar*)(bitmap + 1);
+  advances = (int*)(chars + extra);
+  rows = advances + count;
+  spans = (SpriteSpan*)(rows + count * h + 1);
+
+  for (g = 0, extra = 0; g < count; ++g) {
+    code = text ? pixl_utf8(&text) : (Uint32)(first + g);
+    if (code < 256) {
+      bitmap->latin1[code] = g;
+    } else {
+      chars[extra].code = code;
+      chars[extra++].index = g;
+    }
+    if (lua_istable(L, 5)) {
+      lua_rawgeti(L, 5, g + 1);
+      advance = luaL_optinteger(L, -1, w);
+      luaL_argcheck(L, (advance >= 0) && (advance <= PIXL_MAX_GLYPH_SIZE), 5, "invalid advance");
+      lua_pop(L, 1);
+    } else {
+      advance = luaL_optinteger(L, 5, w);
+    }
+    advances[g] = (int)advance;
+  }
+  SDL_qsort(chars, extra, sizeof(FontChar), pixl_compare_font_chars);
+
+  for (g = 0, total = 0; g < count; ++g) {
+    for (py = 0; py < h; ++py) {
+      src = data + py * count * w + g * w;
+      rows[g * h + py] = total;
+      for (px = 0; px < w; ++px) {
+        if (!src[px]) continue;
+        if ((px == 0) || !src[px - 1]) {
+          spans[total].x = px;
+          spans[total++].length = 0;
+        }
+        ++spans[total - 1].length;
+      }
     }
   }
+  rows[count * h] = total;
+  luaL_setmetatable(L, PIXL_FONT_METATABLE);
+  return 1;
+}
+
+static int pixl_font_print(lua_State *L) {
+  const BitmapFont *bitmap = (const BitmapFont*)luaL_checkudata(L, 1, PIXL_FONT_METATABLE);
+  Uint8 color = (Uint8)luaL_checkinteger(L, 2);
+  int x = (int)luaL_checknumber(L, 3);
+  int y = (int)luaL_checknumber(L, 4);
+  const char *text = luaL_checkstring(L, 5);
+  if (recording) {
+    if (pixl_bitmap_record(bitmap, color, x, y, text)) return luaL_error(L, "out of memory");
+  } else {
+    pixl_bitmap_print(bitmap, color, x, y, text);
+  }
   return 0;
 }
 
+static int pixl_font_textwidth(lua_State *L) {
+  const BitmapFont *bitmap = (const BitmapFont*)luaL_checkudata(L, 1, PIXL_FONT_METATABLE);
+  const char *text = luaL_checkstring(L, 2);
+  const int *advances = (const int*)((const FontChar*)(bitmap + 1) + bitmap->extra);
+  lua_Integer width = 0;
+  int g;
+  while (*text) {
+    g = pixl_bitmap_index(bitmap, pixl_utf8(&text));
+    width += g < 0 ? bitmap->width : advances[g];
+  }
+  lua_pushinteger(L, width);
+  return 1;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -887,8 +3158,51 @@ static int pixl_f_clipboard(lua_State *L) {
 }
 
 static int pixl_f_time(lua_State *L) {
-  lua_Number ticks = (lua_Number)SDL_GetTicks();
-  lua_pushnumber(L, ticks / 1000.0);
+  if (headless) {
+    lua_pushnumber(L, (lua_Number)frame_count / PIXL_HEADLESS_FPS);
+  } else {
+    lua_Number ticks = (lua_Number)SDL_GetTicks();
+    lua_pushnumber(L, ticks / 1000.0);
+  }
+  return 1;
+}
+
+static int pixl_f_clock(lua_State *L) {
+  lua_pushnumber(L, (lua_Number)SDL_GetPerformanceCounter() / (lua_Number)SDL_GetPerformanceFrequency());
+  return 1;
+}
+
+static int pixl_f_stats(lua_State *L) {
+  static const char *phases[] = { "events", "update", "gc", "convert", "copy", "present", "frame" };
+  Uint64 values[PIXL_STATS_FRAMES];
+  double scale = 1000.0 / (double)SDL_GetPerformanceFrequency();
+  int phase, i, j;
+
+  lua_createtable(L, 0, PIXL_PHASE_COUNT + 1);
+  for (phase = 0; phase < PIXL_PHASE_COUNT; ++phase) {
+    Uint64 sum = 0;
+    // insertion sort the completed frames, the current frame is still running
+    for (i = 0; i < frame_stats_count; ++i) {
+      Uint64 value = frame_stats[(frame_stats_index + PIXL_STATS_FRAMES - 1 - i) % PIXL_STATS_FRAMES][phase];
+      for (j = i; (j > 0) && (values[j - 1] > value); --j) values[j] = values[j - 1];
+      values[j] = value;
+      sum += value;
+    }
+    lua_createtable(L, 0, 4);
+    if (frame_stats_count > 0) {
+      lua_pushnumber(L, (lua_Number)(values[0] * scale));
+      lua_setfield(L, -2, "min");
+      lua_pushnumber(L, (lua_Number)(sum * scale / frame_stats_count));
+      lua_setfield(L, -2, "avg");
+      lua_pushnumber(L, (lua_Number)(values[(frame_stats_count * 99 + 99) / 100 - 1] * scale));
+      lua_setfield(L, -2, "p99");
+      lua_pushnumber(L, (lua_Number)(values[frame_stats_count - 1] * scale));
+      lua_setfield(L, -2, "max");
+    }
+    lua_setfield(L, -2, phases[phase]);
+  }
+  lua_pushinteger(L, frame_stats_count);
+  lua_setfield(L, -2, "frames");
   return 1;
 }
 
@@ -904,11 +3218,51 @@ static int pixl_f_cursor(lua_State *L) {
 //  Lua Module Definition
 //
 ////////////////////////////////////////////////////////////////////////////////
+static const luaL_Reg pixl_list_funcs[] = {
+  { "draw", pixl_list_draw },
+  { NULL, NULL }
+};
+
+static const luaL_Reg pixl_sprite_funcs[] = {
+  { "draw", pixl_sprite_draw },
+  { "transform", pixl_sprite_transform },
+  { NULL, NULL }
+};
+
+static const luaL_Reg pixl_sheet_funcs[] = {
+  { "draw", pixl_sheet_draw },
+  { "transform", pixl_sheet_transform },
+  { NULL, NULL }
+};
+
+static const luaL_Reg pixl_map_funcs[] = {
+  { "get", pixl_map_get },
+  { "set", pixl_map_set },
+  { "draw", pixl_map_draw },
+  { NULL, NULL }
+};
+
+static const luaL_Reg pixl_font_funcs[] = {
+  { "print", pixl_font_print },
+  { "textwidth", pixl_font_textwidth },
+  { NULL, NULL }
+};
+
+static const luaL_Reg pixl_grid_funcs[] = {
+  { "insert", pixl_grid_insert },
+  { "move", pixl_grid_move },
+  { "remove", pixl_grid_remove },
+  { "query", pixl_grid_query },
+  { "pairs", pixl_grid_pairs },
+  { NULL, NULL }
+};
+
 static const luaL_Reg pixl_funcs[] = {
   { "color", pixl_f_color },
   { "resolution", pixl_f_resolution },
   { "translate", pixl_f_translate },
   { "clip", pixl_f_clip },
+  { "threads", pixl_f_threads },
   { "glyph", pixl_f_glyph },
 
   { "clear", pixl_f_clear },
@@ -916,9 +3270,24 @@ static const luaL_Reg pixl_funcs[] = {
   { "rect", pixl_f_rect },
   { "circle", pixl_f_circle },
   { "line", pixl_f_line },
+  { "triangle", pixl_f_triangle },
+  { "polygon", pixl_f_polygon },
 
   { "print", pixl_f_print },
+  { "textwidth", pixl_f_textwidth },
   { "sprite", pixl_f_sprite },
+  { "batch", pixl_f_batch },
+
+  { "record", pixl_f_record },
+  { "stop", pixl_f_stop },
+
+  { "newsprite", pixl_f_newsprite },
+  { "newsheet", pixl_f_newsheet },
+  { "newmap", pixl_f_newmap },
+  { "collide", pixl_f_collide },
+  { "newgrid", pixl_f_newgrid },
+  { "newfont", pixl_f_newfont },
+  { "spritecache", pixl_f_spritecache },
 
   { "sound", pixl_f_sound },
 
@@ -939,12 +3308,51 @@ static const luaL_Reg pixl_funcs[] = {
   { "title", pixl_f_title },
   { "clipboard", pixl_f_clipboard },
   { "time", pixl_f_time },
+  { "clock", pixl_f_clock },
+  { "stats", pixl_f_stats },
   { "cursor", pixl_f_cursor },
 
   { NULL, NULL }
 };
 
 static int pixl_open(lua_State *L) {
+  lua_newtable(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, PIXL_SPRITE_CACHE_ANCHORS);
+
+  luaL_newmetatable(L, PIXL_LIST_METATABLE);
+  luaL_newlib(L, pixl_list_funcs);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, PIXL_SPRITE_METATABLE);
+  luaL_newlib(L, pixl_sprite_funcs);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, PIXL_SHEET_METATABLE);
+  luaL_newlib(L, pixl_sheet_funcs);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, pixl_sheet_len);
+  lua_setfield(L, -2, "__len");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, PIXL_MAP_METATABLE);
+  luaL_newlib(L, pixl_map_funcs);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, PIXL_FONT_METATABLE);
+  luaL_newlib(L, pixl_font_funcs);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, PIXL_GRID_METATABLE);
+  luaL_newlib(L, pixl_grid_funcs);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, pixl_grid_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
   luaL_newlib(L, pixl_funcs);
 
   lua_pushstring(L, "Sebastian Steinhauer <s.steinhauer@yahoo.de>");
@@ -962,28 +3370,86 @@ static int pixl_open(lua_State *L) {
 //  Event Loop
 //
 ////////////////////////////////////////////////////////////////////////////////
+static void pixl_upload_rect(lua_State *L, int x1, int y1, int x2, int y2) {
+  SDL_Rect rect = { x1, y1, x2 - x1, y2 - y1 };
+  Uint8 *pixels;
+  int pitch;
+
+  if (texture == NULL) {
+    pitch = screen_width * sizeof(Uint32);
+    pixl_convert_rect((Uint8*)(offscreen + (y1 * screen_width) + x1), pitch, &rect);
+    return;
+  }
+  if (SDL_LockTexture(texture, &rect, (void**)&pixels, &pitch)) luaL_error(L, "SDL_LockTexture() failed: %s", SDL_GetError());
+  pixl_convert_rect(pixels, pitch, &rect);
+  SDL_UnlockTexture(texture);
+}
+
+static void pixl_upload_dirty_tiles(lua_State *L) {
+  int tx, ty, x1, y2;
+  Uint8 *row;
+  Uint64 start = SDL_GetPerformanceCounter();
+
+  for (ty = 0, row = dirty_tiles; ty < dirty_tiles_height; ++ty, row += dirty_tiles_width) {
+    for (tx = 0; tx < dirty_tiles_width;) {
+      if (!row[tx]) { ++tx; continue; }
+      for (x1 = tx; (tx < dirty_tiles_width) && row[tx]; ++tx) row[tx] = 0;
+
+      // merge following tile rows which are completely dirty as well
+      y2 = ty + 1;
+      if ((x1 == 0) && (tx == dirty_tiles_width)) {
+        for (; y2 < dirty_tiles_height; ++y2) {
+          Uint8 *next = dirty_tiles + (y2 * dirty_tiles_width);
+          int i;
+          for (i = 0; (i < dirty_tiles_width) && next[i]; ++i);
+          if (i < dirty_tiles_width) break;
+          SDL_memset(next, 0, dirty_tiles_width);
+        }
+      }
+
+      pixl_upload_rect(L,
+        x1 << PIXL_DIRTY_TILE_SHIFT, ty << PIXL_DIRTY_TILE_SHIFT,
+        SDL_min(tx << PIXL_DIRTY_TILE_SHIFT, screen_width), SDL_min(y2 << PIXL_DIRTY_TILE_SHIFT, screen_height));
+    }
+  }
+  convert_time = (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+}
+
 static void pixl_render_screen(lua_State *L) {
+  Uint64 start = SDL_GetPerformanceCounter();
+
+  if (palette_dirty) {
+    pixl_update_palette();
+    pixl_mark_dirty_all();
+  }
+
+  if (headless) {
+    if (screen_dirty) pixl_upload_dirty_tiles(L);
+    pixl_stats_phase(PIXL_PHASE_CONVERT, &start);
+    screen_dirty = SDL_FALSE;
+    return;
+  }
+
+  // nothing changed since the last frame, so don't burn CPU on the same image
+  if (!screen_dirty && !screen_exposed) {
+    SDL_Delay(idle_delay);
+    pixl_stats_phase(PIXL_PHASE_PRESENT, &start);
+    return;
+  }
+
   if (SDL_SetRenderDrawColor(renderer, colors[0].r, colors[0].g, colors[0].b, 255)) luaL_error(L, "SDL_SetRenderDrawColor() failed: %s", SDL_GetError());
   if (SDL_RenderClear(renderer)) luaL_error(L, "SDL_RenderClear() failed: %s", SDL_GetError());
 
   if (texture != NULL) {
-    SDL_Color *color;
-    Uint8 *pixels, *p;
-    int x, y, pitch;
-
-    if (SDL_LockTexture(texture, NULL, (void**)&pixels, &pitch)) luaL_error(L, "SDL_LockTexture() failed: %s", SDL_GetError());
-    for (y = 0; y < screen_height; ++y) {
-      p = pixels + (y * pitch);
-      for (x = 0; x < screen_width; ++x) {
-        color = &colors[screen[x][y] & 15];
-        *p++ = 255; *p++ = color->b; *p++ = color->g; *p++ = color->r;
-      }
-    }
-    SDL_UnlockTexture(texture);
+    if (screen_dirty) pixl_upload_dirty_tiles(L);
+    pixl_stats_phase(PIXL_PHASE_CONVERT, &start);
     if (SDL_RenderCopy(renderer, texture, NULL, NULL)) luaL_error(L, "SDL_RenderCopy() failed: %s", SDL_GetError());
+    pixl_stats_phase(PIXL_PHASE_COPY, &start);
   }
 
   SDL_RenderPresent(renderer);
+  pixl_stats_phase(PIXL_PHASE_PRESENT, &start);
+  screen_dirty = screen_exposed = SDL_FALSE;
 }
 
 static void pixl_update_buttons(int mask, int down) {
@@ -1046,6 +3512,12 @@ static void pixl_handle_SDL_event(lua_State *L, const SDL_Event *ev) {
     case SDL_QUIT:
       running = SDL_FALSE;
       break;
+    case SDL_WINDOWEVENT:
+      if (ev->window.event != SDL_WINDOWEVENT_MOVED) screen_exposed = SDL_TRUE;
+      break;
+    case SDL_RENDER_DEVICE_RESET:
+      pixl_mark_dirty_all();
+      break;
     case SDL_MOUSEMOTION:
       mouse.x = ev->motion.x;
       mouse.y = ev->motion.y;
@@ -1088,22 +3560,41 @@ static void pixl_run_event_loop(lua_State *L) {
 
   last_tick = SDL_GetTicks();
   while (running) {
+    Uint64 frame_start = SDL_GetPerformanceCounter(), start = frame_start;
+    frame_stats_index = (frame_stats_index + 1) % PIXL_STATS_FRAMES;
+    SDL_zero(frame_stats[frame_stats_index]);
+
     buttons_pressed = 0;
     textinput[0] = 0;
     while (SDL_PollEvent(&ev)) pixl_handle_SDL_event(L, &ev);
+    pixl_stats_phase(PIXL_PHASE_EVENTS, &start);
 
     current_tick = SDL_GetTicks();
     delta_ticks = current_tick - last_tick;
     last_tick = current_tick;
 
     if (lua_getglobal(L, "update") == LUA_TFUNCTION) {
-      lua_pushnumber(L, (lua_Number)delta_ticks / 1000.0);
+      // headless runs use a virtual clock, so every run is reproducible
+      if (headless) lua_pushnumber(L, 1.0 / PIXL_HEADLESS_FPS);
+      else lua_pushnumber(L, (lua_Number)delta_ticks / 1000.0);
       lua_call(L, 1, 0);
     } else {
       lua_pop(L, 1);
     }
+    // a recording never outlives the frame, so nothing stays captured for good
+    recording = SDL_FALSE;
+    pixl_stats_phase(PIXL_PHASE_UPDATE, &start);
+
+    // do a bit of garbage collection every frame, so it shows up in the stats
+    lua_gc(L, LUA_GCSTEP, 0);
+    pixl_stats_phase(PIXL_PHASE_GC, &start);
 
     pixl_render_screen(L);
+    frame_stats[frame_stats_index][PIXL_PHASE_FRAME] = SDL_GetPerformanceCounter() - frame_start;
+    // one slot of the ring buffer always belongs to the running frame
+    if (frame_stats_count < PIXL_STATS_FRAMES - 1) ++frame_stats_count;
+    ++frame_count;
+    if ((headless_frames > 0) && (frame_count >= (Uint32)headless_frames)) running = SDL_FALSE;
   }
 }
 
@@ -1113,21 +3604,7 @@ static void pixl_run_event_loop(lua_State *L) {
 //  Init & Shutdown routines
 //
 ////////////////////////////////////////////////////////////////////////////////
-static int pixl_init(lua_State *L) {
-  #if _WIN32
-    WSADATA wsa;
-    if (WSAStartup(MAKEWORD(2, 2), &wsa) != NO_ERROR) luaL_error(L, "WSAStartup() failed!");
-  #endif // _WIN32
-
-  if (SDL_Init(SDL_INIT_EVERYTHING)) luaL_error(L, "SDL_Init() failed: %s", SDL_GetError());
-  window = SDL_CreateWindow("PiXL Window", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 256, 240, SDL_WINDOW_RESIZABLE);
-  if (window == NULL) luaL_error(L, "SDL_CreateWindow() failed: %s", SDL_GetError());
-  renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-  if (renderer == NULL) luaL_error(L, "SDL_CreateRenderer() failed: %s", SDL_GetError());
-  SDL_StartTextInput();
-  pixl_set_resolution(L, 256, 240, 0.0);
-  pixl_open_controllers(L);
-
+static void pixl_open_audio(lua_State *L) {
   SDL_AudioSpec want, have;
   SDL_zero(want); SDL_zero(have); SDL_zero(sound_channels);
   want.freq = 44100;
@@ -1142,6 +3619,30 @@ static int pixl_init(lua_State *L) {
   if (have.channels != 1) luaL_error(L, "SDL_OpenAudioDevice() created wrong number of channels");
   sound_sample_rate = (float)have.freq;
   SDL_PauseAudioDevice(audio_device, SDL_FALSE);
+}
+
+static int pixl_init(lua_State *L) {
+  #if _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != NO_ERROR) luaL_error(L, "WSAStartup() failed!");
+  #endif // _WIN32
+
+  if (headless) {
+    SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS | SDL_INIT_TIMER)) luaL_error(L, "SDL_Init() failed: %s", SDL_GetError());
+  } else {
+    if (SDL_Init(SDL_INIT_EVERYTHING)) luaL_error(L, "SDL_Init() failed: %s", SDL_GetError());
+    window = SDL_CreateWindow("PiXL Window", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 256, 240, SDL_WINDOW_RESIZABLE);
+    if (window == NULL) luaL_error(L, "SDL_CreateWindow() failed: %s", SDL_GetError());
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    if (renderer == NULL) luaL_error(L, "SDL_CreateRenderer() failed: %s", SDL_GetError());
+    SDL_StartTextInput();
+  }
+  pixl_select_palette_converter();
+  pixl_start_convert_workers(L, thread_count);
+  pixl_set_resolution(L, 256, 240, 0.0);
+  pixl_open_controllers(L);
+  if (!headless) pixl_open_audio(L);
 
   if (luaL_loadfile(L, "game.lua") != LUA_OK) lua_error(L);
   lua_call(L, 0, 0);
@@ -1151,8 +3652,17 @@ static int pixl_init(lua_State *L) {
 }
 
 static void pixl_shutdown() {
+  pixl_stop_convert_workers();
   if (audio_device) SDL_CloseAudioDevice(audio_device);
   if (texture) SDL_DestroyTexture(texture);
+  if (offscreen) SDL_free(offscreen);
+  if (screen) SDL_free(screen);
+  if (dirty_tiles) SDL_free(dirty_tiles);
+  if (polygon_edges) SDL_free(polygon_edges);
+  if (polygon_points) SDL_free(polygon_points);
+  if (record_buffer) SDL_free(record_buffer);
+  if (font_glyphs) SDL_free(font_glyphs);
+  pixl_sprite_cache_trim(NULL, 0);
   if (renderer) SDL_DestroyRenderer(renderer);
   if (window) SDL_DestroyWindow(window);
   SDL_Quit();
@@ -1163,6 +3673,26 @@ static void pixl_shutdown() {
   #endif // _WIN32
 }
 
+static int pixl_parse_args(int argc, char **argv) {
+  // returns 0 on success, same thread count range as pixl.threads()
+  char *end;
+  long count;
+  int i;
+  for (i = 1; i < argc; ++i) {
+    if ((SDL_strcmp(argv[i], "--threads") == 0) && (i + 1 < argc)) {
+      count = SDL_strtol(argv[++i], &end, 10);
+      if ((end == argv[i]) || *end || (count < 0) || (count > PIXL_MAX_THREADS)) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "PiXL: invalid thread count '%s', expected 0 to %d", argv[i], PIXL_MAX_THREADS);
+        return 1;
+      }
+      thread_count = (int)count;
+    }
+    else if ((SDL_strcmp(argv[i], "--frames") == 0) && (i + 1 < argc)) headless_frames = SDL_atoi(argv[++i]);
+    else if (SDL_strcmp(argv[i], "--headless") == 0) headless = SDL_TRUE;
+  }
+  return 0;
+}
+
 static void pixl_register_arg(lua_State *L, int argc, char **argv) {
   int i;
   lua_newtable(L);
@@ -1174,7 +3704,10 @@ static void pixl_register_arg(lua_State *L, int argc, char **argv) {
 }
 
 int main(int argc, char **argv) {
-  lua_State *L = luaL_newstate();
+  int status = 0;
+  lua_State *L;
+  if (pixl_parse_args(argc, argv)) return 1;
+  L = luaL_newstate();
   pixl_register_arg(L, argc, argv);
   luaL_openlibs(L);
   luaL_requiref(L, "pixl", pixl_open, 0);
@@ -1184,9 +3717,14 @@ int main(int argc, char **argv) {
   lua_pushcfunction(L, pixl_init);
   if (lua_pcall(L, 0, 0, -2) != LUA_OK) {
     const char *msg = luaL_gsub(L, lua_tostring(L, -1), "\t", "  ");
-    SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "PiXL Panic", msg, window);
+    if (headless) {
+      SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "PiXL Panic: %s", msg);
+      status = 1;
+    } else {
+      SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "PiXL Panic", msg, window);
+    }
   }
   lua_close(L);
   pixl_shutdown();
-  return 0;
+  return status;
 }